@@ -0,0 +1,12 @@
+
+-- partition health
+CREATE FUNCTION plproxy_health (
+    OUT partition text,
+    OUT state text,
+    OUT failures int4,
+    OUT last_failure timestamptz,
+    OUT last_error text)
+RETURNS SETOF record AS 'plproxy' LANGUAGE C;
+
+CREATE VIEW plproxy_partition_health AS SELECT * FROM plproxy_health();
+
@@ -42,6 +42,14 @@ static struct AATree cluster_tree;
  */
 static struct AATree fake_cluster_tree;
 
+/*
+ * Connection states of whole backend.
+ *
+ * Keyed by canonical connect string including user info,
+ * so clusters that point to same database share connections.
+ */
+static struct AATree state_tree;
+
 /* plan for fetching cluster version */
 static void *version_plan;
 
@@ -71,6 +79,28 @@ static const char *cluster_config_options[] = {
 	"keepalive_idle",
 	"keepalive_interval",
 	"keepalive_count",
+	"prewarm",
+	"connection_idle_timeout",
+	"set_role",
+	"drain_timeout",
+	"application_name",
+	"options",
+	"prefer_replicas",
+	"hedge_delay",
+	"partition_weights",
+	"any_retries",
+	"max_parallel_connects",
+	"max_parallel_queries",
+	"partial_deadline",
+	"partial_min_percent",
+	NULL
+};
+
+/* options above that take string values */
+static const char *cluster_string_options[] = {
+	"application_name",
+	"options",
+	"partition_weights",
 	NULL
 };
 
@@ -111,26 +141,146 @@ static void conn_free(struct AANode *node, void *arg)
 	aatree_destroy(&conn->userstate_tree);
 	if (conn->res)
 		PQclear(conn->res);
+	if (conn->host)
+		pfree((void *)conn->host);
+	if (conn->health_key)
+		pfree((void *)conn->health_key);
+	pfree((void *)conn->connstr);
 	pfree(conn);
 }
 
-static int state_user_cmp(uintptr_t val, struct AANode *node)
+static int state_cstr_cmp(uintptr_t val, struct AANode *node)
 {
-	const char *name = (const char *)val;
+	const char *connstr = (const char *)val;
 	const ProxyConnectionState *state = container_of(node, ProxyConnectionState, node);
 
-	return strcmp(name, state->userinfo->username);
+	return strcmp(connstr, state->connstr);
+}
+
+/*
+ * All states are also kept in a ring, maintenance
+ * walks it a few states at a time.
+ */
+static ProxyConnectionState *maint_ring = NULL;		/* first state in ring */
+static ProxyConnectionState *maint_cursor = NULL;	/* next state to check */
+static int	maint_left = 0;							/* states left in this round */
+
+static void maint_ring_add(ProxyConnectionState *state)
+{
+	if (maint_ring == NULL)
+	{
+		state->maint_next = state;
+		state->maint_prev = state;
+		maint_ring = state;
+		return;
+	}
+
+	/* insert before first, so current round does not see it */
+	state->maint_next = maint_ring;
+	state->maint_prev = maint_ring->maint_prev;
+	state->maint_prev->maint_next = state;
+	maint_ring->maint_prev = state;
+}
+
+static void maint_ring_remove(ProxyConnectionState *state)
+{
+	ProxyConnectionState *next = state->maint_next;
+
+	if (next == state)
+		next = NULL;
+	if (maint_cursor == state)
+		maint_cursor = next;
+	if (maint_ring == state)
+		maint_ring = next;
+
+	state->maint_prev->maint_next = state->maint_next;
+	state->maint_next->maint_prev = state->maint_prev;
+}
+
+/*
+ * All states are also kept in a list in order of use, least recently
+ * used first.  Eviction for plproxy.max_connections looks from the start.
+ */
+static ProxyConnectionState *lru_first = NULL;
+static ProxyConnectionState *lru_last = NULL;
+
+static void lru_remove(ProxyConnectionState *state)
+{
+	if (state->lru_prev)
+		state->lru_prev->lru_next = state->lru_next;
+	else
+		lru_first = state->lru_next;
+	if (state->lru_next)
+		state->lru_next->lru_prev = state->lru_prev;
+	else
+		lru_last = state->lru_prev;
+	state->lru_next = NULL;
+	state->lru_prev = NULL;
+}
+
+static void lru_append(ProxyConnectionState *state)
+{
+	state->lru_prev = lru_last;
+	state->lru_next = NULL;
+	if (lru_last)
+		lru_last->lru_next = state;
+	else
+		lru_first = state;
+	lru_last = state;
+}
+
+/* move state to end of LRU list */
+void
+plproxy_touch_connection(ProxyConnectionState *state)
+{
+	if (state == lru_last)
+		return;
+	lru_remove(state);
+	lru_append(state);
 }
 
 static void state_free(struct AANode *node, void *arg)
 {
 	ProxyConnectionState *state = container_of(node, ProxyConnectionState, node);
 
+	maint_ring_remove(state);
+	lru_remove(state);
 	plproxy_disconnect(state);
+
+	/* may contain password */
+	memset(state->connstr, 0, strlen(state->connstr));
+	pfree(state->connstr);
+
 	memset(state, 0, sizeof(*state));
 	pfree(state);
 }
 
+static int ref_user_cmp(uintptr_t val, struct AANode *node)
+{
+	const char *name = (const char *)val;
+	const ConnUserRef *ref = container_of(node, ConnUserRef, node);
+
+	return strcmp(name, ref->userinfo->username);
+}
+
+/* drop reference to shared state, free it if last one */
+static void ref_free(struct AANode *node, void *arg)
+{
+	ConnUserRef *ref = container_of(node, ConnUserRef, node);
+	ProxyConnection *conn = container_of(arg, ProxyConnection, userstate_tree);
+	ProxyConnectionState *state = ref->state;
+
+	if (conn->cur == state)
+		conn->cur = NULL;
+	if (state->cur_conn == conn)
+		state->cur_conn = NULL;
+
+	if (--state->refcount == 0)
+		aatree_remove(&state_tree, (uintptr_t)state->connstr);
+
+	pfree(ref);
+}
+
 static int userinfo_cmp(uintptr_t val, struct AANode *node)
 {
 	const char *name = (const char *)val;
@@ -169,6 +319,78 @@ plproxy_cluster_cache_init(void)
 										ALLOCSET_SMALL_MAXSIZE);
 	aatree_init(&cluster_tree, cluster_name_cmp, NULL);
 	aatree_init(&fake_cluster_tree, cluster_name_cmp, NULL);
+	aatree_init(&state_tree, state_cstr_cmp, state_free);
+}
+
+/*
+ * In set_role mode connections are made as session user,
+ * unless connect info specifies other user.
+ */
+static const char *
+get_session_username(void)
+{
+	return GetUserNameFromId(GetSessionUserId()
+#if PG_VERSION_NUM >= 90500
+							 , false
+#endif
+		);
+}
+
+/* add key='val' to connect string, with quoting */
+static void
+append_connstr_param(StringInfo buf, const char *key, const char *val)
+{
+	const char *p;
+
+	if (buf->len > 0)
+		appendStringInfoChar(buf, ' ');
+	appendStringInfo(buf, "%s='", key);
+	for (p = val; *p; p++)
+	{
+		if (*p == '\\' || *p == '\'')
+			appendStringInfoChar(buf, '\\');
+		appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '\'');
+}
+
+/*
+ * Bring connect string to canonical form, so that strings
+ * that differ only in whitespace, quoting or key order
+ * map to same connection.
+ *
+ * Returns palloc'd string.
+ */
+static char *
+canonical_connstr(const char *connstr)
+{
+#if PG_VERSION_NUM >= 80400
+	PQconninfoOption *opts, *opt;
+	char	   *errmsg = NULL;
+	StringInfoData buf;
+
+	opts = PQconninfoParse(connstr, &errmsg);
+	if (opts == NULL)
+	{
+		/* let connect report the problem */
+		if (errmsg)
+			PQfreemem(errmsg);
+		return pstrdup(connstr);
+	}
+
+	/* libpq returns keys always in same order */
+	initStringInfo(&buf);
+	for (opt = opts; opt->keyword; opt++)
+	{
+		if (opt->val == NULL)
+			continue;
+		append_connstr_param(&buf, opt->keyword, opt->val);
+	}
+	PQconninfoFree(opts);
+	return buf.data;
+#else
+	return pstrdup(connstr);
+#endif
 }
 
 /* initialize plans on demand */
@@ -218,12 +440,23 @@ plproxy_cluster_plan_init(void)
 static void
 free_connlist(ProxyCluster *cluster)
 {
+	int			i;
+
 	aatree_destroy(&cluster->conn_tree);
 
+	for (i = 0; i < cluster->part_count; i++)
+	{
+		if (cluster->replica_map[i])
+			pfree(cluster->replica_map[i]);
+	}
+	pfree(cluster->replica_map);
+	pfree(cluster->replica_count);
 	pfree(cluster->part_map);
 	pfree(cluster->active_list);
 
 	cluster->part_map = NULL;
+	cluster->replica_map = NULL;
+	cluster->replica_count = NULL;
 	cluster->part_count = 0;
 	cluster->part_mask = 0;
 	cluster->active_count = 0;
@@ -232,11 +465,14 @@ free_connlist(ProxyCluster *cluster)
 /*
  * Add new database connection if it does not exists.
  */
-static void
-add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
+static ProxyConnection *
+get_connection(ProxyCluster *cluster, const char *orig_connstr)
 {
 	struct AANode *node;
 	ProxyConnection *conn = NULL;
+	char	   *connstr = canonical_connstr(orig_connstr);
+	char	   *host;
+	char	   *key;
 
 	/* check if already have it */
 	node = aatree_search(&cluster->conn_tree, (uintptr_t)connstr);
@@ -250,12 +486,53 @@ add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
 		conn->connstr = MemoryContextStrdup(cluster_mem, connstr);
 		conn->cluster = cluster;
 
-		aatree_init(&conn->userstate_tree, state_user_cmp, state_free);
+		host = plproxy_dns_host(connstr);
+		if (host)
+		{
+			conn->host = MemoryContextStrdup(cluster_mem, host);
+			pfree(host);
+		}
+		key = plproxy_health_key(connstr);
+		if (key)
+		{
+			conn->health_key = MemoryContextStrdup(cluster_mem, key);
+			pfree(key);
+		}
+
+		aatree_init(&conn->userstate_tree, ref_user_cmp, ref_free);
 
-		aatree_insert(&cluster->conn_tree, (uintptr_t)connstr, &conn->node);
+		aatree_insert(&cluster->conn_tree, (uintptr_t)conn->connstr, &conn->node);
 	}
 
-	cluster->part_map[part_num] = conn;
+	pfree(connstr);
+	return conn;
+}
+
+static void
+add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
+{
+	cluster->part_map[part_num] = get_connection(cluster, connstr);
+}
+
+/* add replica for partition, order does not matter */
+static void
+add_replica(ProxyCluster *cluster, const char *connstr, int part_num)
+{
+	ProxyConnection *conn = get_connection(cluster, connstr);
+	ProxyConnection ***list = &cluster->replica_map[part_num];
+	int			n = cluster->replica_count[part_num];
+
+	if (*list == NULL)
+		*list = MemoryContextAlloc(cluster_mem, sizeof(ProxyConnection *));
+	else
+		*list = repalloc(*list, (n + 1) * sizeof(ProxyConnection *));
+	(*list)[n] = conn;
+	cluster->replica_count[part_num] = n + 1;
+
+	/* hedged queries may activate replicas next to primaries */
+	cluster->replica_total++;
+	cluster->active_list = repalloc(cluster->active_list,
+									(cluster->part_count + cluster->replica_total) * sizeof(ProxyConnection *));
 }
 
 /*
@@ -292,7 +569,56 @@ get_version(ProxyFunction *func, Datum dname)
 static void
 clear_config(ProxyConfig *cf)
 {
+	if (cf->options)
+		pfree(cf->options);
+	if (cf->part_weights)
+		pfree(cf->part_weights);
 	memset(cf, 0, sizeof(*cf));
+	cf->drain_timeout = PLPROXY_DRAIN_TIMEOUT;
+}
+
+/*
+ * Parse partition_weights: list of integers separated
+ * by commas or spaces, one for each partition.
+ */
+static void
+set_part_weights(ProxyFunction *func, ProxyConfig *cf, const char *val)
+{
+	const char *p = val;
+	char	   *end;
+	long		w;
+	int			n = 0,
+				alloc = 16;
+	int		   *list;
+
+	list = MemoryContextAlloc(cluster_mem, alloc * sizeof(int));
+	while (1)
+	{
+		while (*p == ',' || *p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+			break;
+
+		w = strtol(p, &end, 10);
+		if (end == p || w < 0 || w > 1000)
+		{
+			pfree(list);
+			plproxy_error(func, "Invalid partition_weights: %s", val);
+		}
+		p = end;
+
+		if (n == alloc)
+		{
+			alloc *= 2;
+			list = repalloc(list, alloc * sizeof(int));
+		}
+		list[n++] = w;
+	}
+
+	if (cf->part_weights)
+		pfree(cf->part_weights);
+	cf->part_weights = list;
+	cf->part_weight_count = n;
 }
 
 /* set a configuration option. */
@@ -315,10 +641,86 @@ set_config_key(ProxyFunction *func, ProxyConfig *cf, const char *key, const char
 		cf->keepcnt = atoi(val);
 	else if (pg_strcasecmp("default_user", key) == 0)
 		snprintf(cf->default_user, sizeof(cf->default_user), "%s", val);
+	else if (pg_strcasecmp("prewarm", key) == 0)
+		cf->prewarm = atoi(val);
+	else if (pg_strcasecmp("connection_idle_timeout", key) == 0)
+		cf->connection_idle_timeout = atoi(val);
+	else if (pg_strcasecmp("set_role", key) == 0)
+		cf->set_role = atoi(val);
+	else if (pg_strcasecmp("drain_timeout", key) == 0)
+		cf->drain_timeout = atoi(val);
+	else if (pg_strcasecmp("application_name", key) == 0)
+		snprintf(cf->application_name, sizeof(cf->application_name), "%s", val);
+	else if (pg_strcasecmp("options", key) == 0)
+	{
+		if (cf->options)
+			pfree(cf->options);
+		cf->options = MemoryContextStrdup(cluster_mem, val);
+	}
+	else if (pg_strcasecmp("prefer_replicas", key) == 0)
+		cf->prefer_replicas = atoi(val);
+	else if (pg_strcasecmp("hedge_delay", key) == 0)
+		cf->hedge_delay = atoi(val);
+	else if (pg_strcasecmp("partition_weights", key) == 0)
+		set_part_weights(func, cf, val);
+	else if (pg_strcasecmp("any_retries", key) == 0)
+		cf->any_retries = atoi(val);
+	else if (pg_strcasecmp("max_parallel_connects", key) == 0)
+		cf->max_parallel_connects = atoi(val);
+	else if (pg_strcasecmp("max_parallel_queries", key) == 0)
+		cf->max_parallel_queries = atoi(val);
+	else if (pg_strcasecmp("partial_deadline", key) == 0)
+		cf->partial_deadline = atoi(val);
+	else if (pg_strcasecmp("partial_min_percent", key) == 0)
+		cf->partial_min_percent = atoi(val);
 	else
 		plproxy_error(func, "Unknown config param: %s", key);
 }
 
+static void drop_conn_refs(struct AANode *node, void *arg)
+{
+	ProxyConnection *conn = container_of(node, ProxyConnection, node);
+
+	aatree_destroy(&conn->userstate_tree);
+}
+
+/*
+ * Build libpq startup parameters from cluster config.
+ *
+ * They are sent in the startup packet, so the remote backend
+ * is set up without extra round-trips after connect.
+ */
+static void
+update_startup_params(ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+	StringInfoData buf;
+
+	initStringInfo(&buf);
+#if PG_VERSION_NUM >= 90100
+	append_connstr_param(&buf, "client_encoding", GetDatabaseEncodingName());
+#endif
+	if (cf->application_name[0])
+		append_connstr_param(&buf, "application_name", cf->application_name);
+	if (cf->options)
+		append_connstr_param(&buf, "options", cf->options);
+
+	if (cluster->startup_params)
+	{
+		if (strcmp(cluster->startup_params, buf.data) == 0)
+		{
+			pfree(buf.data);
+			return;
+		}
+
+		/* connections were made with old settings */
+		aatree_walk(&cluster->conn_tree, AA_WALK_IN_ORDER, drop_conn_refs, NULL);
+		pfree(cluster->startup_params);
+	}
+	cluster->startup_params = MemoryContextStrdup(cluster_mem, buf.data);
+	pfree(buf.data);
+}
+
 /*
  * Fetch cluster configuration.
  */
@@ -362,6 +764,7 @@ get_config(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 
 		set_config_key(func, &cluster->config, key, val);
 	}
+	update_startup_params(cluster);
 
 	return 0;
 }
@@ -378,10 +781,14 @@ allocate_cluster_partitions(ProxyCluster *cluster, int nparts)
 
 	cluster->part_count = nparts;
 	cluster->part_mask = cluster->part_count - 1;
+	cluster->topology_seq++;
 
 	/* allocate lists */
 	old_ctx = MemoryContextSwitchTo(cluster_mem);
 	cluster->part_map = palloc0(nparts * sizeof(ProxyConnection *));
+	cluster->replica_count = palloc0(nparts * sizeof(int));
+	cluster->replica_map = palloc0(nparts * sizeof(ProxyConnection **));
+	cluster->replica_total = 0;
 	cluster->active_list = palloc0(nparts * sizeof(ProxyConnection *));
 	MemoryContextSwitchTo(old_ctx);
 }
@@ -409,6 +816,8 @@ reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 		plproxy_error(func, "Partition config must have at least 1 columns");
 	if (SPI_gettypeid(desc, 1) != TEXTOID)
 		plproxy_error(func, "partition column 1 must be text");
+	if (desc->natts >= 2 && SPI_gettypeid(desc, 2) != TEXTARRAYOID)
+		plproxy_error(func, "partition column 2 must be text[]");
 
 	allocate_cluster_partitions(cluster, SPI_processed);
 
@@ -422,6 +831,31 @@ reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 			plproxy_error(func, "connstr must not be NULL");
 
 		add_connection(cluster, connstr, i);
+
+		/* optional replica list */
+		if (desc->natts >= 2)
+		{
+			Datum		val;
+			bool		isnull;
+			Datum	   *elems;
+			bool	   *nulls;
+			int			nelems,
+						j;
+
+			val = SPI_getbinval(row, desc, 2, &isnull);
+			if (isnull)
+				continue;
+			deconstruct_array(DatumGetArrayTypeP(val), TEXTOID, -1, false, 'i',
+							  &elems, &nulls, &nelems);
+			for (j = 0; j < nelems; j++)
+			{
+				if (nulls[j])
+					continue;
+				connstr = DatumGetCString(DirectFunctionCall1(textout, elems[j]));
+				add_replica(cluster, connstr, i);
+				pfree(connstr);
+			}
+		}
 	}
 
 	return 0;
@@ -450,6 +884,28 @@ extract_part_num(const char *partname, int *part_num)
 	return false;
 }
 
+/* extract partition number from replica option: p0_replica1 */
+static bool
+extract_replica_num(const char *name, int *part_num)
+{
+	char		buf[NAMEDATALEN];
+	const char *p;
+	char	   *errptr;
+
+	p = strstr(name, "_replica");
+	if (p == NULL || p - name >= NAMEDATALEN)
+		return false;
+
+	/* replica number is only for uniqueness */
+	strtoul(p + strlen("_replica"), &errptr, 10);
+	if (errptr == p + strlen("_replica") || *errptr != '\0')
+		return false;
+
+	memcpy(buf, name, p - name);
+	buf[p - name] = '\0';
+	return extract_part_num(buf, part_num);
+}
+
 /*
  * Validate single cluster option
  */
@@ -467,7 +923,14 @@ validate_cluster_option(const char *name, const char *arg)
 
 	if (*opt == NULL)
 		elog(ERROR, "Pl/Proxy: invalid server option: %s", name);
-	else if (strspn(arg, "0123456789") != strlen(arg))
+
+	for (opt = cluster_string_options; *opt; opt++)
+	{
+		if (pg_strcasecmp(*opt, name) == 0)
+			return;
+	}
+
+	if (strspn(arg, "0123456789") != strlen(arg))
 		elog(ERROR, "Pl/Proxy: only integer options are allowed: %s=%s",
 			 name, arg);
 }
@@ -504,7 +967,11 @@ plproxy_fdw_validator(PG_FUNCTION_ARGS)
 
 		if (catalog == ForeignServerRelationId)
 		{
-			if (extract_part_num(def->defname, &part_num))
+			if (extract_replica_num(def->defname, &part_num))
+			{
+				/* replica, checked against partition count on load */
+			}
+			else if (extract_part_num(def->defname, &part_num))
 			{
 				/* partition definition */
 				if (part_num != part_count)
@@ -560,9 +1027,14 @@ reload_sqlmed_user(ProxyFunction *func, ProxyCluster *cluster)
 	ListCell		   *cell;
 	AclResult			aclresult;
 	bool				got_user;
+	bool				set_role = (cluster->config.set_role > 0);
 
 
-	um = GetUserMapping(userinfo->user_oid, cluster->sqlmed_server_oid);
+	/* in set_role mode, all users connect with PUBLIC mapping */
+	if (set_role)
+		um = GetUserMapping(InvalidOid, cluster->sqlmed_server_oid);
+	else
+		um = GetUserMapping(userinfo->user_oid, cluster->sqlmed_server_oid);
 
 	/* retry same lookup so we can set cache stamp... */
     tup = SearchSysCache(USERMAPPINGUSERSERVER,
@@ -586,7 +1058,7 @@ reload_sqlmed_user(ProxyFunction *func, ProxyCluster *cluster)
 	/*
 	 * Check permissions, user must have usage on the server.
 	 */
-	aclresult = pg_foreign_server_aclcheck(um->serverid, um->userid, ACL_USAGE);
+	aclresult = pg_foreign_server_aclcheck(um->serverid, userinfo->user_oid, ACL_USAGE);
 	if (aclresult != ACLCHECK_OK)
 		aclcheck_error(aclresult, ACL_KIND_FOREIGN_SERVER, cluster->name);
 
@@ -605,7 +1077,9 @@ reload_sqlmed_user(ProxyFunction *func, ProxyCluster *cluster)
 
 	/* make sure we have 'user=' in connect string */
 	if (!got_user)
-		appendStringInfo(&cstr, " user='%s'", userinfo->username);
+		appendStringInfo(&cstr, " user='%s'",
+						 set_role ? get_session_username() : userinfo->username);
+	userinfo->set_role = set_role;
 
 	/* free old string */
 	if (userinfo->extra_connstr)
@@ -681,7 +1155,9 @@ reload_sqlmed_cluster(ProxyFunction *func, ProxyCluster *cluster,
 	{
 		DefElem    *def = lfirst(cell);
 
-		if (extract_part_num(def->defname, &part_num))
+		if (extract_replica_num(def->defname, &part_num))
+			continue;
+		else if (extract_part_num(def->defname, &part_num))
 		{
 			if (part_num != part_count)
 				plproxy_error(func, "partitions numbers must be consecutive");
@@ -691,6 +1167,7 @@ reload_sqlmed_cluster(ProxyFunction *func, ProxyCluster *cluster,
 		else
 			set_config_key(func, &cluster->config, def->defname, strVal(def->arg));
 	}
+	update_startup_params(cluster);
 
 	if (!check_valid_partcount(part_count))
 		plproxy_error(func, "invalid partition count");
@@ -705,10 +1182,14 @@ reload_sqlmed_cluster(ProxyFunction *func, ProxyCluster *cluster,
 	{
 		DefElem    *def = lfirst(cell);
 
-		if (!extract_part_num(def->defname, &part_num))
-			continue;
-
-		add_connection(cluster, strVal(def->arg), part_num);
+		if (extract_replica_num(def->defname, &part_num))
+		{
+			if (part_num >= part_count)
+				plproxy_error(func, "replica for unknown partition: %s", def->defname);
+			add_replica(cluster, strVal(def->arg), part_num);
+		}
+		else if (extract_part_num(def->defname, &part_num))
+			add_connection(cluster, strVal(def->arg), part_num);
 	}
 }
 
@@ -856,6 +1337,8 @@ reload_plproxy_cluster(ProxyFunction *func, ProxyCluster *cluster)
 	Datum 	dname = DirectFunctionCall1(textin, CStringGetDatum(cluster->name));
 	int		cur_version;
 
+	/* config functions are called via SPI */
+	plproxy_spi_connect();
 	plproxy_cluster_plan_init();
 
 	/* fetch serial, also check if exists */
@@ -881,6 +1364,8 @@ new_cluster(const char *name)
 
 	cluster = palloc0(sizeof(*cluster));
 	cluster->name = pstrdup(name);
+	clear_config(&cluster->config);
+	update_startup_params(cluster);
 
 	aatree_init(&cluster->conn_tree, conn_cstr_cmp, conn_free);
 	aatree_init(&cluster->userinfo_tree, userinfo_cmp, userinfo_free);
@@ -895,21 +1380,23 @@ new_cluster(const char *name)
  */
 #ifdef PLPROXY_USE_SQLMED
 
-static void inval_userinfo_state(struct AANode *node, void *arg)
-{
-	ProxyConnectionState *cur = container_of(node, ProxyConnectionState, node);
-	ConnUserInfo *userinfo = arg;
-
-	if (cur->userinfo == userinfo && cur->db)
-		plproxy_disconnect(cur);
-}
-
 static void inval_userinfo_conn(struct AANode *node, void *arg)
 {
 	ProxyConnection *conn = container_of(node, ProxyConnection, node);
 	ConnUserInfo *userinfo = arg;
+	struct AANode *n;
+	ConnUserRef *ref;
 
-	aatree_walk(&conn->userstate_tree, AA_WALK_IN_ORDER, inval_userinfo_state, userinfo);
+	/*
+	 * Connect string changes, so drop link to the state.
+	 * Connection is closed if no other cluster uses it.
+	 */
+	n = aatree_search(&conn->userstate_tree, (uintptr_t)userinfo->username);
+	if (!n)
+		return;
+	ref = container_of(n, ConnUserRef, node);
+	if (ref->userinfo == userinfo)
+		aatree_remove(&conn->userstate_tree, (uintptr_t)userinfo->username);
 }
 
 static void inval_user_connections(ProxyCluster *cluster, ConnUserInfo *userinfo)
@@ -1042,6 +1529,10 @@ refresh_cluster(ProxyFunction *func, ProxyCluster *cluster)
 
 #endif
 
+	/* connect info depends on set_role */
+	if (cluster->sqlmed_cluster && uinfo->set_role != (cf->set_role > 0))
+		uinfo->needs_reload = true;
+
 	/* SQL/MED user reload */
 	if (uinfo->needs_reload)
 	{
@@ -1063,14 +1554,66 @@ refresh_cluster(ProxyFunction *func, ProxyCluster *cluster)
 	cluster->needs_reload = false;
 }
 
+/*
+ * Release fake cluster with its connections.
+ */
+static void
+free_fake_cluster(ProxyCluster *cluster)
+{
+	aatree_remove(&fake_cluster_tree, (uintptr_t)cluster->name);
+	plproxy_function_forget_cluster(cluster);
+
+	free_connlist(cluster);
+	aatree_destroy(&cluster->userinfo_tree);
+	clear_config(&cluster->config);
+	pfree(cluster->startup_params);
+	pfree((void *)cluster->name);
+	pfree(cluster);
+}
+
+/*
+ * Fake cluster can be dropped only if no query or
+ * result set is using it.
+ */
+static bool
+fake_cluster_idle(ProxyCluster *cluster)
+{
+	return !cluster->busy && cluster->active_count == 0;
+}
+
+static void find_lru_cluster(struct AANode *n, void *arg)
+{
+	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
+	ProxyCluster **lru = arg;
+
+	if (!fake_cluster_idle(cluster))
+		return;
+	if (!*lru || cluster->use_seq < (*lru)->use_seq)
+		*lru = cluster;
+}
+
+/*
+ * Drop least recently used fake cluster to make room for new one.
+ * If all are in use, the limit is exceeded temporarily.
+ */
+static void
+evict_fake_cluster(void)
+{
+	ProxyCluster *lru = NULL;
+
+	aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, find_lru_cluster, &lru);
+	if (lru)
+		free_fake_cluster(lru);
+}
+
 /*
  * Get cached or create new fake cluster.
  */
 static ProxyCluster *
 fake_cluster(ProxyFunction *func, const char *connect_str)
 {
+	static uint64 use_counter = 0;
 	ProxyCluster *cluster;
-	MemoryContext old_ctx;
 	struct AANode *n;
 
 	/* search if cached */
@@ -1081,25 +1624,25 @@ fake_cluster(ProxyFunction *func, const char *connect_str)
 		goto done;
 	}
 
+	/* keep the number of cached clusters bounded */
+	if (plproxy_max_connect_clusters > 0 &&
+		fake_cluster_tree.count >= plproxy_max_connect_clusters)
+		evict_fake_cluster();
+
 	/* create if not */
 	cluster = new_cluster(connect_str);
 
-	old_ctx = MemoryContextSwitchTo(cluster_mem);
-
 	cluster->fake_cluster = true;
 	cluster->version = 1;
-	cluster->part_count = 1;
-	cluster->part_mask = 0;
-	cluster->part_map = palloc(cluster->part_count * sizeof(ProxyConnection *));
-	cluster->active_list = palloc(cluster->part_count * sizeof(ProxyConnection *));
-
-	MemoryContextSwitchTo(old_ctx);
+	allocate_cluster_partitions(cluster, 1);
 
 	add_connection(cluster, connect_str, 0);
 
 	aatree_insert(&fake_cluster_tree, (uintptr_t)connect_str, &cluster->node);
 
 done:
+	cluster->use_seq = ++use_counter;
+	cluster->last_used = time(NULL);
 	refresh_cluster(func, cluster);
 	return cluster;
 }
@@ -1183,6 +1726,64 @@ plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo)
 	return cluster;
 }
 
+/*
+ * Full connect string for user, in canonical form.
+ */
+static char *
+get_user_connstr(ProxyConnection *conn, ConnUserInfo *info)
+{
+	StringInfoData cstr;
+	char	   *res;
+
+	/* partition connect string overrides cluster startup params */
+	initStringInfo(&cstr);
+	appendStringInfo(&cstr, "%s %s", conn->cluster->startup_params, conn->connstr);
+
+	if (strstr(conn->connstr, "user=") != NULL)
+		/* user given in connect string */ ;
+	else if (info->extra_connstr)
+		appendStringInfo(&cstr, " %s", info->extra_connstr);
+	else if (conn->cluster->config.set_role > 0)
+		appendStringInfo(&cstr, " user='%s'", get_session_username());
+	else
+		appendStringInfo(&cstr, " user='%s'", info->username);
+
+	res = canonical_connstr(cstr.data);
+	memset(cstr.data, 0, cstr.len);
+	pfree(cstr.data);
+	return res;
+}
+
+/*
+ * Find shared connection state for user or create new one.
+ */
+static ProxyConnectionState *
+get_shared_state(ProxyConnection *conn, ConnUserInfo *userinfo)
+{
+	ProxyConnectionState *state;
+	struct AANode *node;
+	char	   *connstr;
+
+	connstr = get_user_connstr(conn, userinfo);
+
+	node = aatree_search(&state_tree, (uintptr_t)connstr);
+	if (node)
+		state = container_of(node, ProxyConnectionState, node);
+	else
+	{
+		state = MemoryContextAllocZero(cluster_mem, sizeof(*state));
+		state->connstr = MemoryContextStrdup(cluster_mem, connstr);
+		aatree_insert(&state_tree, (uintptr_t)state->connstr, &state->node);
+		maint_ring_add(state);
+		lru_append(state);
+	}
+	state->refcount++;
+
+	memset(connstr, 0, strlen(connstr));
+	pfree(connstr);
+	return state;
+}
+
 /*
  * Move connection to active list and init current
  * connection state.
@@ -1193,7 +1794,7 @@ void plproxy_activate_connection(struct ProxyConnection *conn)
 	ConnUserInfo *userinfo = cluster->cur_userinfo;
 	const char *username = userinfo->username;
 	struct AANode *node;
-	ProxyConnectionState *cur;
+	ConnUserRef *ref;
 
 	/* move connection to active_list */
 	cluster->active_list[cluster->active_count] = conn;
@@ -1203,90 +1804,227 @@ void plproxy_activate_connection(struct ProxyConnection *conn)
 
 	node = aatree_search(&conn->userstate_tree, (uintptr_t)username);
 	if (node) {
-		cur = container_of(node, ProxyConnectionState, node);
+		ref = container_of(node, ConnUserRef, node);
 	} else {
-		cur = MemoryContextAllocZero(cluster_mem, sizeof(*cur));
-		cur->userinfo = userinfo;
-		aatree_insert(&conn->userstate_tree, (uintptr_t)username, &cur->node);
+		ref = MemoryContextAllocZero(cluster_mem, sizeof(*ref));
+		ref->userinfo = userinfo;
+		ref->state = get_shared_state(conn, userinfo);
+		aatree_insert(&conn->userstate_tree, (uintptr_t)username, &ref->node);
 	}
-	conn->cur = cur;
+	conn->cur = ref->state;
+	conn->cur->cur_conn = conn;
+	conn->cur->in_use++;
 }
 
 /*
- * Clean old connections and results from all clusters.
+ * Connection budget: close least recently used idle connection.
  */
 
-struct MaintInfo {
-	struct ProxyConfig *cf;
-	struct timeval *now;
-};
+/* connections closed because of plproxy.max_connections, since last report */
+static int evicted_conns = 0;
+
+bool
+plproxy_evict_idle_connection(void)
+{
+	ProxyConnectionState *lru;
+
+	for (lru = lru_first; lru; lru = lru->lru_next)
+	{
+		if (!lru->db || lru->in_use > 0)
+			continue;
+		if (lru->state == C_READY || lru->state == C_DONE)
+			break;
+	}
+	if (!lru)
+		return false;
+
+	plproxy_disconnect(lru);
+	evicted_conns++;
+	return true;
+}
 
-static void clean_state(struct AANode *node, void *arg)
+/*
+ * Clean old connections and results.
+ *
+ * Connection settings come from cluster that used it last.
+ */
+static void
+clean_state(ProxyConnectionState *cur, struct timeval *now)
 {
-	ProxyConnectionState *cur = container_of(node, ProxyConnectionState, node);
-	ConnUserInfo *uinfo = cur->userinfo;
-	struct MaintInfo *maint = arg;
-	ProxyConfig *cf = maint->cf;
-	struct timeval *now = maint->now;
-	time_t		age;
+	ProxyConnection *conn = cur->cur_conn;
+	ProxyConfig *cf;
+	int64		age;
+	time_t		last_use;
 	bool		drop;
 
-	if (!cur->db)
+	/* running call or set-returning function still reading results */
+	if (cur->in_use > 0)
 		return;
 
-	drop = false;
+	if (!cur->db)
+		return;
 	if (PQstatus(cur->db) != CONNECTION_OK)
 	{
-		drop = true;
+		plproxy_disconnect(cur);
+		return;
 	}
-	else if (uinfo->needs_reload)
-	{
+	if (!conn)
+		return;
+	cf = &conn->cluster->config;
+
+	/* finish abandoned query, replace connection nearing lifetime */
+	if (cur->draining)
+		plproxy_drain_connection(cf, cur, now->tv_sec);
+	plproxy_recycle_connection(conn, cur, now);
+	if (!cur->db)
+		return;
+
+	drop = false;
+	/* msecs, so short lifetimes are not cut by second boundary */
+	age = (int64) (now->tv_sec - cur->connect_time.tv_sec) * 1000
+		+ (now->tv_usec - cur->connect_time.tv_usec) / 1000;
+	if (cf->connection_lifetime > 0 && age >= (int64) cf->connection_lifetime * 1000)
+		drop = true;
+
+	/* prewarmed connection may not have been used yet */
+	last_use = Max(cur->query_time, cur->connect_time.tv_sec);
+	if (cf->connection_idle_timeout > 0 &&
+		now->tv_sec - last_use >= cf->connection_idle_timeout)
 		drop = true;
-	}
-	else if (cf->connection_lifetime <= 0)
-	{
-		/* no aging */
-	}
-	else
-	{
-		age = now->tv_sec - cur->connect_time;
-		if (age >= cf->connection_lifetime)
-			drop = true;
-	}
 
 	if (drop)
 		plproxy_disconnect(cur);
 }
 
+/*
+ * Collect fake clusters that have been unused too long.
+ */
+struct IdleInfo {
+	time_t		limit;
+	ProxyCluster **list;
+	int			count;
+};
+
+static void find_idle_cluster(struct AANode *n, void *arg)
+{
+	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
+	struct IdleInfo *info = arg;
+
+	if (cluster->last_used < info->limit && fake_cluster_idle(cluster))
+		info->list[info->count++] = cluster;
+}
+
+static void
+drop_idle_fake_clusters(struct timeval *now)
+{
+	struct IdleInfo info;
+	int			i;
+
+	if (fake_cluster_tree.count == 0)
+		return;
+
+	/* cannot remove while walking the tree */
+	info.limit = now->tv_sec - plproxy_connect_cluster_idle_timeout;
+	info.list = palloc(fake_cluster_tree.count * sizeof(ProxyCluster *));
+	info.count = 0;
+	aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, find_idle_cluster, &info);
+
+	for (i = 0; i < info.count; i++)
+		free_fake_cluster(info.list[i]);
+	pfree(info.list);
+}
+
+/*
+ * Free results left on connections that are not in any call.
+ */
 static void clean_conn(struct AANode *node, void *arg)
 {
 	ProxyConnection *conn = container_of(node, ProxyConnection, node);
-	struct MaintInfo *maint = arg;
 
-	if (conn->res)
+	if (conn->res && !conn->cur)
 	{
 		PQclear(conn->res);
 		conn->res = NULL;
 	}
-
-	aatree_walk(&conn->userstate_tree, AA_WALK_IN_ORDER, clean_state, maint);
 }
 
 static void clean_cluster(struct AANode *n, void *arg)
 {
 	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
-	struct MaintInfo maint;
 
-	maint.cf = &cluster->config;
-	maint.now = arg;
+	aatree_walk(&cluster->conn_tree, AA_WALK_IN_ORDER, clean_conn, NULL);
+}
+
+/*
+ * Find cluster by its last execution.
+ *
+ * Cluster pointers kept across calls may be freed, so they are looked
+ * up by id instead.  NULL if the cluster is gone or has run again.
+ */
+struct ExecInfo {
+	uint64		exec_id;
+	ProxyCluster *found;
+};
+
+static void find_exec_cluster(struct AANode *n, void *arg)
+{
+	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
+	struct ExecInfo *info = arg;
+
+	if (cluster->exec_id == info->exec_id)
+		info->found = cluster;
+}
 
-	aatree_walk(&cluster->conn_tree, AA_WALK_IN_ORDER, clean_conn, &maint);
+ProxyCluster *
+plproxy_find_exec_cluster(uint64 exec_id)
+{
+	struct ExecInfo info;
+
+	info.exec_id = exec_id;
+	info.found = NULL;
+	aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, find_exec_cluster, &info);
+	if (!info.found)
+		aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, find_exec_cluster, &info);
+	return info.found;
 }
 
 void
 plproxy_cluster_maint(struct timeval * now)
 {
-	aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, clean_cluster, now);
-	aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, clean_cluster, now);
+	if (evicted_conns > 0)
+	{
+		elog(LOG, "PL/Proxy: closed %d idle connections to stay within plproxy.max_connections",
+			 evicted_conns);
+		evicted_conns = 0;
+	}
+
+	aatree_walk(&cluster_tree, AA_WALK_IN_ORDER, clean_cluster, NULL);
+
+	if (plproxy_connect_cluster_idle_timeout > 0)
+		drop_idle_fake_clusters(now);
+	aatree_walk(&fake_cluster_tree, AA_WALK_IN_ORDER, clean_cluster, NULL);
+
+	/* start new round over connections */
+	maint_cursor = maint_ring;
+	maint_left = state_tree.count;
+}
+
+/*
+ * Check next slice of connections in current round.
+ */
+void
+plproxy_cluster_maint_step(struct timeval * now)
+{
+	ProxyConnectionState *cur;
+	int			n;
+
+	for (n = 0; n < PLPROXY_MAINT_SLICE && maint_left > 0 && maint_cursor; n++)
+	{
+		cur = maint_cursor;
+		maint_cursor = cur->maint_next;
+		maint_left--;
+
+		clean_state(cur, now);
+	}
 }
 
@@ -0,0 +1,328 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Copyright (c) 2006 Sven Suursoho, Skype Technologies OÜ
+ * Copyright (c) 2007 Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Cache for partition host addresses.
+ *
+ * libpq resolves host names with blocking getaddrinfo() in
+ * PQconnectStart().  Here each distinct host is resolved when
+ * first seen, and connections are started with all its addresses
+ * in hostaddr=, so libpq does not need to look it up again.
+ * Entries in use are refreshed during maintenance before they
+ * expire, one per call, so a call waits for at most one lookup.
+ */
+
+#include "plproxy.h"
+
+#include <sys/time.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+/* One cached host */
+typedef struct DnsEntry {
+	struct AANode node;
+	char	   *host;			/* Host name, key */
+	char	   *addrs;			/* Resolved addresses, comma-separated */
+	char	   *hosts;			/* Host name repeated for each address */
+	time_t		resolve_time;	/* When last resolved */
+	time_t		use_time;		/* When last used */
+} DnsEntry;
+
+/* host->DnsEntry tree, in own context */
+static struct AATree dns_tree;
+static MemoryContext dns_mem = NULL;
+
+static int dns_cmp(uintptr_t val, struct AANode *node)
+{
+	const char *name = (const char *)val;
+	const DnsEntry *entry = container_of(node, DnsEntry, node);
+
+	return strcmp(name, entry->host);
+}
+
+static void dns_free(struct AANode *node, void *arg)
+{
+	DnsEntry *entry = container_of(node, DnsEntry, node);
+
+	if (entry->addrs)
+		pfree(entry->addrs);
+	if (entry->hosts)
+		pfree(entry->hosts);
+	pfree(entry->host);
+	pfree(entry);
+}
+
+static void
+dns_cache_init(void)
+{
+	dns_mem = AllocSetContextCreate(TopMemoryContext,
+									"PL/Proxy DNS cache",
+									ALLOCSET_SMALL_MINSIZE,
+									ALLOCSET_SMALL_INITSIZE,
+									ALLOCSET_DEFAULT_MAXSIZE);
+	aatree_init(&dns_tree, dns_cmp, dns_free);
+}
+
+/*
+ * Resolve host, on failure keep previous addresses.
+ */
+static void
+resolve_entry(DnsEntry *entry, time_t now)
+{
+	struct addrinfo hints, *res = NULL, *ai;
+	int			err;
+	int			count = 0;
+	void	   *ip;
+	char		addr[64];
+	StringInfoData addrs, hosts;
+	MemoryContext old_ctx;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	entry->resolve_time = now;
+	err = getaddrinfo(entry->host, NULL, &hints, &res);
+	if (err != 0 || res == NULL)
+	{
+		elog(LOG, "PL/Proxy: could not resolve host \"%s\": %s",
+			 entry->host, err ? gai_strerror(err) : "no address");
+		if (res)
+			freeaddrinfo(res);
+		return;
+	}
+
+	/* libpq wants same number of entries in host and hostaddr */
+	old_ctx = MemoryContextSwitchTo(dns_mem);
+	initStringInfo(&addrs);
+	initStringInfo(&hosts);
+	for (ai = res; ai && count < PLPROXY_DNS_MAX_ADDRS; ai = ai->ai_next)
+	{
+		if (ai->ai_family == AF_INET6)
+			ip = &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+		else if (ai->ai_family == AF_INET)
+			ip = &((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+		else
+			continue;
+		if (!inet_ntop(ai->ai_family, ip, addr, sizeof(addr)))
+			continue;
+		if (count > 0)
+		{
+			appendStringInfoChar(&addrs, ',');
+			appendStringInfoChar(&hosts, ',');
+		}
+		appendStringInfoString(&addrs, addr);
+		appendStringInfoString(&hosts, entry->host);
+		count++;
+	}
+	MemoryContextSwitchTo(old_ctx);
+	freeaddrinfo(res);
+
+	if (count == 0)
+	{
+		pfree(addrs.data);
+		pfree(hosts.data);
+		return;
+	}
+
+	if (entry->addrs)
+		pfree(entry->addrs);
+	if (entry->hosts)
+		pfree(entry->hosts);
+	entry->addrs = addrs.data;
+	entry->hosts = hosts.data;
+}
+
+/*
+ * Return host name from connect string, if it needs resolving.
+ *
+ * Returns NULL for unix sockets, numeric addresses, multiple
+ * hosts and when hostaddr is already given.  Result is palloc'd.
+ */
+char *
+plproxy_dns_host(const char *connstr)
+{
+#if PG_VERSION_NUM >= 80400
+	PQconninfoOption *opts, *opt;
+	char	   *errmsg = NULL;
+	const char *host = NULL;
+	bool		has_addr = false;
+	char	   *result = NULL;
+	unsigned char buf[sizeof(struct in6_addr)];
+
+	opts = PQconninfoParse(connstr, &errmsg);
+	if (opts == NULL)
+	{
+		if (errmsg)
+			PQfreemem(errmsg);
+		return NULL;
+	}
+
+	for (opt = opts; opt->keyword; opt++)
+	{
+		if (opt->val == NULL || opt->val[0] == 0)
+			continue;
+		if (strcmp(opt->keyword, "host") == 0)
+			host = opt->val;
+		else if (strcmp(opt->keyword, "hostaddr") == 0)
+			has_addr = true;
+	}
+
+	if (host && !has_addr && !is_absolute_path(host) && !strchr(host, ',')
+		&& inet_pton(AF_INET, host, buf) != 1
+		&& inet_pton(AF_INET6, host, buf) != 1)
+		result = pstrdup(host);
+
+	PQconninfoFree(opts);
+	return result;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Return cached addresses for host, comma-separated, and host name
+ * repeated as many times.  New host is resolved right away, as libpq
+ * would do it anyway, later refresh happens in plproxy_dns_maint().
+ *
+ * Returns false if cache is disabled or host does not resolve,
+ * then libpq should do the lookup itself.
+ */
+bool
+plproxy_dns_lookup(const char *host, const char **hosts_p, const char **addrs_p)
+{
+	struct AANode *node;
+	DnsEntry   *entry;
+	time_t		now;
+
+	if (plproxy_dns_cache_ttl <= 0)
+		return false;
+	if (!dns_mem)
+		dns_cache_init();
+
+	now = time(NULL);
+	node = aatree_search(&dns_tree, (uintptr_t)host);
+	if (node)
+		entry = container_of(node, DnsEntry, node);
+	else
+	{
+		entry = MemoryContextAllocZero(dns_mem, sizeof(*entry));
+		entry->host = MemoryContextStrdup(dns_mem, host);
+		aatree_insert(&dns_tree, (uintptr_t)entry->host, &entry->node);
+		resolve_entry(entry, now);
+	}
+	entry->use_time = now;
+
+	if (!entry->addrs)
+		return false;
+	*hosts_p = entry->hosts;
+	*addrs_p = entry->addrs;
+	return true;
+}
+
+/*
+ * Maintenance: drop unused entries and list the ones that
+ * will expire before next maintenance.  The listed ones are
+ * refreshed few at a time by plproxy_dns_maint_step(), so one
+ * call does not wait for all the lookups.
+ */
+struct DnsMaint {
+	time_t		now;
+	DnsEntry  **drop_list;
+	int			drop_count;
+};
+
+/* entries to refresh in current round, in dns_mem */
+static DnsEntry **refresh_list = NULL;
+static int	refresh_count = 0;
+static int	refresh_pos = 0;
+
+static void dns_maint_entry(struct AANode *node, void *arg)
+{
+	DnsEntry   *entry = container_of(node, DnsEntry, node);
+	struct DnsMaint *maint = arg;
+	time_t		expire = entry->resolve_time + plproxy_dns_cache_ttl;
+
+	if (maint->now - entry->use_time >= plproxy_dns_cache_ttl + PLPROXY_MAINT_PERIOD)
+		maint->drop_list[maint->drop_count++] = entry;
+	else if (expire - maint->now < PLPROXY_MAINT_PERIOD)
+		refresh_list[refresh_count++] = entry;
+}
+
+static void
+reset_refresh_list(void)
+{
+	if (refresh_list)
+		pfree(refresh_list);
+	refresh_list = NULL;
+	refresh_count = 0;
+	refresh_pos = 0;
+}
+
+void
+plproxy_dns_maint(struct timeval *now)
+{
+	struct DnsMaint maint;
+	int			i;
+
+	reset_refresh_list();
+	if (!dns_mem || dns_tree.count == 0)
+		return;
+
+	/* ttl turned off, forget everything */
+	if (plproxy_dns_cache_ttl <= 0)
+	{
+		aatree_destroy(&dns_tree);
+		return;
+	}
+
+	/* cannot remove while walking the tree */
+	maint.now = now->tv_sec;
+	maint.drop_list = palloc(dns_tree.count * sizeof(DnsEntry *));
+	maint.drop_count = 0;
+	refresh_list = MemoryContextAlloc(dns_mem, dns_tree.count * sizeof(DnsEntry *));
+	aatree_walk(&dns_tree, AA_WALK_IN_ORDER, dns_maint_entry, &maint);
+
+	for (i = 0; i < maint.drop_count; i++)
+		aatree_remove(&dns_tree, (uintptr_t)maint.drop_list[i]->host);
+	pfree(maint.drop_list);
+}
+
+/*
+ * Refresh next few listed entries, called on each call.
+ */
+void
+plproxy_dns_maint_step(struct timeval *now)
+{
+	int			n;
+
+	if (plproxy_dns_cache_ttl <= 0)
+		return;
+
+	for (n = 0; n < PLPROXY_DNS_MAINT_SLICE && refresh_pos < refresh_count; n++)
+		resolve_entry(refresh_list[refresh_pos++], now->tv_sec);
+}
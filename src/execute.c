@@ -27,6 +27,10 @@
 
 #include "plproxy.h"
 
+#include <access/xact.h>
+#include <storage/proc.h>
+#include <utils/timestamp.h>
+
 #include <sys/time.h>
 
 #include "poll_compat.h"
@@ -62,10 +66,78 @@ static int geterrcode(void)
 }
 #endif
 
+/* number of open libpq connections in backend */
+static int open_conn_count = 0;
+
+/* last execution id given to a cluster */
+static uint64 exec_seq = 0;
+
+static bool any_failover(ProxyFunction *func, ProxyConnection *conn,
+						 const char *desc, bool query_sent);
+static bool conn_failed(ProxyFunction *func, ProxyConnection *conn,
+						const char *desc, bool query_sent);
+static void first_fail(ProxyCluster *cluster, ProxyConnection *conn,
+					   const char *msg);
+
+/* msecs since start */
+static int64
+elapsed_msecs(struct timeval *start, struct timeval *now)
+{
+	return (int64) (now->tv_sec - start->tv_sec) * 1000
+		+ (now->tv_usec - start->tv_usec) / 1000;
+}
+
+/*
+ * Make room for new connection under plproxy.max_connections.
+ *
+ * Returns false if all connections are in use.
+ */
+static bool
+reserve_connection(void)
+{
+	if (plproxy_max_connections <= 0)
+		return true;
+	while (open_conn_count >= plproxy_max_connections)
+	{
+		if (!plproxy_evict_idle_connection())
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Start libpq connection, with cached addresses for host if available.
+ */
+static PGconn *
+connect_start(ProxyConnection *conn, const char *connstr)
+{
+	const char *hosts = NULL;
+	const char *addrs = NULL;
+	StringInfoData buf;
+	PGconn	   *db;
+
+	if (!conn->host || !plproxy_dns_lookup(conn->host, &hosts, &addrs))
+		return PQconnectStart(connstr);
+
+	/* later keys override earlier ones */
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "%s host='%s' hostaddr='%s'", connstr, hosts, addrs);
+	db = PQconnectStart(buf.data);
+
+	/* may contain password */
+	memset(buf.data, 0, buf.len);
+	pfree(buf.data);
+	return db;
+}
+
 /* some error happened */
 static void
 conn_error(ProxyFunction *func, ProxyConnection *conn, const char *desc)
 {
+	/* avoid it when there are replicas to choose from */
+	if (conn->cur->state == C_CONNECT_READ || conn->cur->state == C_CONNECT_WRITE)
+		conn->down_time = time(NULL);
+
 	plproxy_error(func, "[%s] %s: %s",
 				  PQdb(conn->cur->db), desc, PQerrorMessage(conn->cur->db));
 }
@@ -109,10 +181,53 @@ flush_connection(ProxyFunction *func, ProxyConnection *conn)
 		conn->cur->state = C_QUERY_WRITE;
 	else if (res == 0)
 		conn->cur->state = C_QUERY_READ;
-	else
+	else if (!conn_failed(func, conn, "PQflush", !conn->cur->tuning))
 		conn_error(func, conn, "PQflush");
 }
 
+/*
+ * Msecs left until local statement_timeout cancels
+ * current statement, 0 if there is no timeout.
+ */
+static int
+local_timeout_left(void)
+{
+	long		secs;
+	int			usecs;
+	long		left;
+
+	if (StatementTimeout <= 0)
+		return 0;
+
+	TimestampDifference(GetCurrentStatementStartTimestamp(),
+						GetCurrentTimestamp(), &secs, &usecs);
+	left = StatementTimeout - (secs * 1000 + usecs / 1000);
+
+	/* 0 would mean no timeout */
+	return (left > 0) ? left : 1;
+}
+
+/*
+ * Remember settings done by tuning query once it has finished.
+ * Failed query is rolled back, then settings stay as they were.
+ */
+static void
+tuning_result(ProxyConnectionState *cur, PGresult *res)
+{
+	if (!cur->tuning)
+		return;
+	if (res == NULL)
+	{
+		snprintf(cur->role, sizeof(cur->role), "%s", cur->tune_role);
+		cur->stmt_timeout = cur->tune_stmt_timeout;
+	}
+	else if (PQresultStatus(res) == PGRES_FATAL_ERROR)
+	{
+		snprintf(cur->tune_role, sizeof(cur->tune_role), "%s", cur->role);
+		cur->tune_stmt_timeout = cur->stmt_timeout;
+	}
+}
+
 /*
  * Small sanity checking for new connections.
  *
@@ -125,7 +240,11 @@ tune_connection(ProxyFunction *func, ProxyConnection *conn)
 {
 	const char *this_enc, *dst_enc;
 	const char *dst_ver;
+	const char *cur_role;
 	StringInfo	sql = NULL;
+	int			res;
+	int			timeout,
+				send_timeout;
 
 	/*
 	 * check if target server has same backend version.
@@ -135,6 +254,8 @@ tune_connection(ProxyFunction *func, ProxyConnection *conn)
 
 	/*
 	 * Make sure remote I/O is done using local server_encoding.
+	 * Normally already set in startup packet, unless connect
+	 * string overrides it or libpq is too old.
 	 */
 	this_enc = GetDatabaseEncodingName();
 	dst_enc = PQparameterStatus(conn->cur->db, "client_encoding");
@@ -145,6 +266,51 @@ tune_connection(ProxyFunction *func, ProxyConnection *conn)
 		appendStringInfo(sql, "set client_encoding = '%s'; ", this_enc);
 	}
 
+	/*
+	 * Switch role on shared connection.  Role is remembered
+	 * only when tuning query succeeds, see another_result().
+	 */
+	cur_role = (func->cur_cluster->config.set_role > 0)
+		? func->cur_cluster->cur_userinfo->username : "";
+	if (strcmp(conn->cur->role, cur_role) != 0)
+	{
+		if (!sql)
+			sql = makeStringInfo();
+		if (cur_role[0])
+			appendStringInfo(sql, "set role %s; ", quote_identifier(cur_role));
+		else
+			appendStringInfo(sql, "reset role; ");
+	}
+	snprintf(conn->cur->tune_role, sizeof(conn->cur->tune_role), "%s", cur_role);
+
+	/*
+	 * Partition should give up on the query when local statement_timeout
+	 * cancels the call, never later.  The value sent is rounded down to
+	 * PLPROXY_TIMEOUT_STEP, so following calls can reuse it until time left
+	 * drops below it.  Not checked after tuning query, the time has moved on.
+	 */
+	if (!conn->cur->tuning)
+	{
+		timeout = local_timeout_left();
+		send_timeout = timeout - timeout % PLPROXY_TIMEOUT_STEP;
+		if (send_timeout <= 0)
+			send_timeout = timeout;
+		conn->cur->tune_stmt_timeout = conn->cur->stmt_timeout;
+		if (timeout > 0 ? (conn->cur->stmt_timeout == 0
+						   || conn->cur->stmt_timeout > timeout
+						   || conn->cur->stmt_timeout < send_timeout)
+			: conn->cur->stmt_timeout != 0)
+		{
+			if (!sql)
+				sql = makeStringInfo();
+			if (timeout > 0)
+				appendStringInfo(sql, "set statement_timeout = %d; ", send_timeout);
+			else
+				appendStringInfo(sql, "reset statement_timeout; ");
+			conn->cur->tune_stmt_timeout = send_timeout;
+		}
+	}
+
 	/*
 	 * if second time in this function, they should be active already.
 	 */
@@ -162,10 +328,15 @@ tune_connection(ProxyFunction *func, ProxyConnection *conn)
 	{
 		conn->cur->tuning = 1;
 		conn->cur->state = C_QUERY_WRITE;
-		if (!PQsendQuery(conn->cur->db, sql->data))
-			conn_error(func, conn, "PQsendQuery");
+		res = PQsendQuery(conn->cur->db, sql->data);
 		pfree(sql->data);
 		pfree(sql);
+		if (!res)
+		{
+			if (!conn_failed(func, conn, "PQsendQuery", false))
+				conn_error(func, conn, "PQsendQuery");
+			return 1;
+		}
 
 		flush_connection(func, conn);
 		return 1;
@@ -189,9 +360,9 @@ send_query(ProxyFunction *func, ProxyConnection *conn,
 	gettimeofday(&now, NULL);
 	conn->cur->query_time = now.tv_sec;
 
-	tune_connection(func, conn);
-	if (conn->cur->tuning)
+	if (tune_connection(func, conn))
 		return;
+	conn->query_start = now;
 
 	/* use binary result only on same backend ver */
 	if (cf->disable_binary == 0 && conn->cur->same_ver)
@@ -218,7 +389,11 @@ send_query(ProxyFunction *func, ProxyConnection *conn,
 							pformats,	/* paramFormats */
 							binary_result);		/* resultformat, 0-text, 1-bin */
 	if (!res)
-		conn_error(func, conn, "PQsendQueryParams");
+	{
+		if (!conn_failed(func, conn, "PQsendQueryParams", false))
+			conn_error(func, conn, "PQsendQueryParams");
+		return;
+	}
 
 	/* flush it down */
 	flush_connection(func, conn);
@@ -239,8 +414,7 @@ check_old_conn(ProxyFunction *func, ProxyConnection *conn, struct timeval * now)
 	/* check if too old */
 	if (cf->connection_lifetime > 0)
 	{
-		t = now->tv_sec - conn->cur->connect_time;
-		if (t >= cf->connection_lifetime)
+		if (elapsed_msecs(&conn->cur->connect_time, now) >= (int64) cf->connection_lifetime * 1000)
 			return false;
 	}
 
@@ -348,12 +522,11 @@ socket_set_keepalive(int fd, int onoff, int keepidle, int keepintvl, int keepcnt
 	return true;
 }
 
-static void setup_keepalive(ProxyConnection *conn)
+static void setup_keepalive(ProxyConfig *config, PGconn *db)
 {
 	struct sockaddr sa;
 	socklen_t salen = sizeof(sa);
-	int fd = PQsocket(conn->cur->db);
-	ProxyConfig *config = &conn->cluster->config;
+	int fd = PQsocket(db);
 
 	/* turn on keepalive */
 	if (!config->keepidle && !config->keepintvl && !config->keepcnt)
@@ -370,26 +543,49 @@ static void setup_keepalive(ProxyConnection *conn)
 static void
 handle_notice(void *arg, const PGresult *res)
 {
-	ProxyConnection *conn = arg;
-	ProxyCluster *cluster = conn->cluster;
-	plproxy_remote_error(cluster->cur_func, conn, res, false);
+	ProxyConnectionState *state = arg;
+	ProxyConnection *conn = state->cur_conn;
+
+	/* connection is shared, pass notice to cluster currently using it */
+	if (conn == NULL || conn->cur != state || state->draining)
+		return;
+	plproxy_remote_error(conn->cluster->cur_func, conn, res, false);
 }
 
-static const char *
-get_connstr(ProxyConnection *conn)
+/*
+ * Launch new connection.
+ *
+ * Returns false if libpq failed immediately,
+ * error message is then available in conn.
+ */
+static bool
+start_connection(ProxyFunction *func, ProxyConnection *conn)
 {
-	StringInfoData cstr;
-	ConnUserInfo *info = conn->cluster->cur_userinfo;
+	gettimeofday(&conn->cur->connect_time, NULL);
+	conn->cur->recycle_jitter = random() % 1000;
 
-	if (strstr(conn->connstr, "user=") != NULL)
-		return pstrdup(conn->connstr);
+	/* connections in use by running query cannot be closed */
+	if (!reserve_connection())
+		plproxy_error(func, "connection limit reached: plproxy.max_connections = %d",
+					  plproxy_max_connections);
 
-	initStringInfo(&cstr);
-	if (info->extra_connstr)
-		appendStringInfo(&cstr, "%s %s", conn->connstr, info->extra_connstr);
-	else
-		appendStringInfo(&cstr, "%s user='%s'", conn->connstr, info->username);
-	return cstr.data;
+	/* launch new connection */
+	conn->cur->db = connect_start(conn, conn->cur->connstr);
+	if (conn->cur->db == NULL)
+		plproxy_error(func, "No memory for PGconn");
+	open_conn_count++;
+
+	/* tag connection dirty */
+	conn->cur->state = C_CONNECT_WRITE;
+
+	if (PQstatus(conn->cur->db) == CONNECTION_BAD)
+		return false;
+
+	/* override default notice handler */
+	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn->cur);
+
+	setup_keepalive(&conn->cluster->config, conn->cur->db);
+	return true;
 }
 
 /* check existing conn status or launch new conn */
@@ -397,10 +593,13 @@ static void
 prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 {
 	struct timeval now;
-	const char *connstr;
 
 	gettimeofday(&now, NULL);
+	conn->launched = true;
 
+	/* state may have been used by other cluster meanwhile */
+	conn->cur->cur_conn = conn;
+	plproxy_touch_connection(conn->cur);
 	conn->cur->waitCancel = 0;
 
 	/* state should be C_READY or C_NONE */
@@ -409,6 +608,7 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 		case C_DONE:
 			conn->cur->state = C_READY;
 		case C_READY:
+			plproxy_recycle_connection(conn, conn->cur, &now);
 			if (check_old_conn(func, conn, &now))
 				return;
 
@@ -416,6 +616,11 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 		case C_CONNECT_WRITE:
 		case C_QUERY_READ:
 		case C_QUERY_WRITE:
+			/* query abandoned after error, let it finish */
+			if (conn->cur->draining && PQstatus(conn->cur->db) == CONNECTION_OK
+				&& now.tv_sec - conn->cur->drain_time < func->cur_cluster->config.drain_timeout)
+				return;
+
 			/* close rotten connection */
 			elog(NOTICE, "PL/Proxy: dropping stale conn");
 			plproxy_disconnect(conn->cur);
@@ -423,24 +628,35 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 			break;
 	}
 
-	conn->cur->connect_time = now.tv_sec;
-
-	/* launch new connection */
-	connstr = get_connstr(conn);
-	conn->cur->db = PQconnectStart(connstr);
-	if (conn->cur->db == NULL)
-		plproxy_error(func, "No memory for PGconn");
-
-	/* tag connection dirty */
-	conn->cur->state = C_CONNECT_WRITE;
+	/* partition is known to be down, dont wait for connect timeout */
+	if (!plproxy_health_allow(conn->health_key))
+	{
+		if (!any_failover(func, conn, "partition down", false))
+			plproxy_error(func, "partition is down: %s", conn->health_key);
+		return;
+	}
 
-	if (PQstatus(conn->cur->db) == CONNECTION_BAD)
+	if (!start_connection(func, conn)
+		&& !conn_failed(func, conn, "PQconnectStart", false))
 		conn_error(func, conn, "PQconnectStart");
+}
 
-	/* override default notice handler */
-	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn);
+/* Add query time to moving average */
+static void
+update_latency(ProxyConnection *conn)
+{
+	struct timeval now;
+	double		msecs;
 
-	setup_keepalive(conn);
+	gettimeofday(&now, NULL);
+	msecs = (now.tv_sec - conn->query_start.tv_sec) * 1000.0
+		+ (now.tv_usec - conn->query_start.tv_usec) / 1000.0;
+
+	if (now.tv_sec - conn->latency_time >= PLPROXY_LATENCY_RESET)
+		conn->latency = msecs;
+	else
+		conn->latency += (msecs - conn->latency) * PLPROXY_LATENCY_WEIGHT;
+	conn->latency_time = now.tv_sec;
 }
 
 /*
@@ -452,22 +668,30 @@ prepare_conn(ProxyFunction *func, ProxyConnection *conn)
 static bool
 another_result(ProxyFunction *func, ProxyConnection *conn)
 {
+	ProxyCluster *cluster = func->cur_cluster;
 	PGresult   *res;
+	const char *msg;
 
 	/* got one */
 	res = PQgetResult(conn->cur->db);
+	tuning_result(conn->cur, res);
 	if (res == NULL)
 	{
 		conn->cur->waitCancel = 0;
-		if (conn->cur->tuning)
+		if (conn->cur->tuning || conn->cur->draining)
 			conn->cur->state = C_READY;
 		else
+		{
 			conn->cur->state = C_DONE;
+			update_latency(conn);
+			plproxy_health_success(conn->health_key);
+		}
+		conn->cur->draining = 0;
 		return false;
 	}
 
-	/* ignore result when waiting for cancel */
-	if (conn->cur->waitCancel)
+	/* ignore result when waiting for cancel or draining */
+	if (conn->cur->waitCancel || conn->cur->draining)
 	{
 		PQclear(res);
 		return true;
@@ -487,6 +711,41 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 			PQclear(res);
 			break;
 		case PGRES_FATAL_ERROR:
+			/* other partitions may have the rows, skip rest of the results */
+			if (func->run_first && conn->run_tag && !conn->cur->tuning)
+			{
+				msg = PQresultErrorField(res, PG_DIAG_MESSAGE_PRIMARY);
+				first_fail(cluster, conn, msg ? msg : PQresultErrorMessage(res));
+				PQclear(res);
+				conn->cur->draining = 1;
+				conn->cur->drain_time = time(NULL);
+				break;
+			}
+
+			/* partial result, skip rest of the results */
+			if (cluster->missing_parts && conn->run_tag && !conn->cur->tuning)
+			{
+				elog(LOG, "PL/Proxy: partition %d: %s, leaving it out",
+					 conn->part_num, PQresultErrorMessage(res));
+				PQclear(res);
+				if (conn->hedge_pair)
+				{
+					conn->hedge_pair->hedge_pair = NULL;
+					conn->hedge_pair = NULL;
+				}
+				else
+					cluster->missing_parts[cluster->missing_count++] = conn->part_num;
+				conn->run_tag = 0;
+				if (conn->res)
+				{
+					PQclear(conn->res);
+					conn->res = NULL;
+				}
+				conn->cur->draining = 1;
+				conn->cur->drain_time = time(NULL);
+				break;
+			}
+
 			if (conn->res)
 				PQclear(conn->res);
 			conn->res = res;
@@ -530,10 +789,12 @@ handle_conn(ProxyFunction *func, ProxyConnection *conn)
 					break;
 				case PGRES_POLLING_OK:
 					conn->cur->state = C_READY;
+					plproxy_health_success(conn->health_key);
 					break;
 				case PGRES_POLLING_ACTIVE:
 				case PGRES_POLLING_FAILED:
-					conn_error(func, conn, "PQconnectPoll");
+					if (!conn_failed(func, conn, "PQconnectPoll", false))
+						conn_error(func, conn, "PQconnectPoll");
 			}
 			break;
 		case C_QUERY_WRITE:
@@ -542,7 +803,11 @@ handle_conn(ProxyFunction *func, ProxyConnection *conn)
 		case C_QUERY_READ:
 			res = PQconsumeInput(conn->cur->db);
 			if (res == 0)
-				conn_error(func, conn, "PQconsumeInput");
+			{
+				if (!conn_failed(func, conn, "PQconsumeInput", !conn->cur->tuning))
+					conn_error(func, conn, "PQconsumeInput");
+				break;
+			}
 
 			/* loop until PQgetResult returns NULL */
 			while (1)
@@ -569,7 +834,7 @@ handle_conn(ProxyFunction *func, ProxyConnection *conn)
  * on small number of sockets.
  */
 static int
-poll_conns(ProxyFunction *func, ProxyCluster *cluster)
+poll_conns(ProxyFunction *func, ProxyCluster *cluster, int timeout_ms)
 {
 	static struct pollfd *pfd_cache = NULL;
 	static int pfd_allocated = 0;
@@ -581,11 +846,12 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	struct pollfd *pf;
 	int numfds = 0;
 	int ev = 0;
+	int count = cluster->active_count;	/* failover may add conns */
 
-	if (pfd_allocated < cluster->active_count)
+	if (pfd_allocated < count)
 	{
 		struct pollfd *tmp;
-		int num = cluster->active_count;
+		int num = count;
 		if (num < 64)
 			num = 64;
 		if (pfd_cache == NULL)
@@ -598,7 +864,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 		pfd_allocated = num;
 	}
 
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < count; i++)
 	{
 		conn = cluster->active_list[i];
 		if (!conn->run_tag)
@@ -629,7 +895,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	}
 
 	/* wait for events */
-	res = poll(pfd_cache, numfds, 1000);
+	res = poll(pfd_cache, numfds, timeout_ms);
 	if (res == 0)
 		return 0;
 	if (res < 0)
@@ -641,7 +907,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 
 	/* now recheck the conns */
 	pf = pfd_cache;
-	for (i = 0; i < cluster->active_count; i++)
+	for (i = 0; i < count; i++)
 	{
 		conn = cluster->active_list[i];
 		if (!conn->run_tag)
@@ -687,17 +953,33 @@ check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn
 		case C_CONNECT_WRITE:
 			if (cf->connect_timeout <= 0)
 				break;
-			if (now - conn->cur->connect_time <= cf->connect_timeout)
+			if (now - conn->cur->connect_time.tv_sec <= cf->connect_timeout)
 				break;
-			plproxy_error(func, "connect timeout to: %s", conn->connstr);
+			conn->down_time = now;
+			if (!conn_failed(func, conn, "connect timeout", false))
+				plproxy_error(func, "connect timeout to: %s", conn->connstr);
 			break;
 
 		case C_QUERY_READ:
 		case C_QUERY_WRITE:
+			if (conn->cur->draining)
+			{
+				if (now - conn->cur->drain_time < cf->drain_timeout)
+					break;
+
+				/* abandoned query takes too long, use new connection */
+				elog(NOTICE, "PL/Proxy: dropping stale conn");
+				plproxy_disconnect(conn->cur);
+				if (!start_connection(func, conn)
+					&& !conn_failed(func, conn, "PQconnectStart", false))
+					conn_error(func, conn, "PQconnectStart");
+				break;
+			}
 			if (cf->query_timeout <= 0)
 				break;
 			if (now - conn->cur->query_time <= cf->query_timeout)
 				break;
+			plproxy_health_failure(conn->health_key, "query timeout");
 			plproxy_error(func, "query timeout");
 			break;
 		default:
@@ -705,133 +987,562 @@ check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn
 	}
 }
 
-/* Run the query on all tagged connections in parallel */
+/*
+ * Leave query running on connection that is not needed anymore.
+ *
+ * The results are skipped later, see drain_abandoned_queries().
+ */
 static void
-remote_execute(ProxyFunction *func)
+abandon_query(ProxyCluster *cluster, ProxyConnection *conn, time_t now)
 {
-	ExecStatusType err;
-	ProxyConnection *conn;
-	ProxyCluster *cluster = func->cur_cluster;
-	int			i,
-				pending = 0;
-	struct timeval now;
+	if (conn->cur->state != C_QUERY_READ && conn->cur->state != C_QUERY_WRITE)
+		return;
 
-	/* either launch connection or send query */
-	for (i = 0; i < cluster->active_count; i++)
+	/* state of interrupted tuning query is unknown */
+	if (cluster->config.drain_timeout <= 0 || conn->cur->tuning)
 	{
-		conn = cluster->active_list[i];
-		if (!conn->run_tag)
-			continue;
-
-		/* check if conn is alive, and launch if not */
-		prepare_conn(func, conn);
-		pending++;
-
-		/* if conn is ready, then send query away */
-		if (conn->cur->state == C_READY)
-			send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+		plproxy_disconnect(conn->cur);
+		return;
 	}
-
-	/* now loop until all results are arrived */
-	while (pending)
+	if (!conn->cur->draining)
 	{
-		/* allow postgres to cancel processing */
-		CHECK_FOR_INTERRUPTS();
-
-		/* wait for events */
-		if (poll_conns(func, cluster) == 0)
-			continue;
-
-		/* recheck */
-		pending = 0;
-		gettimeofday(&now, NULL);
-		for (i = 0; i < cluster->active_count; i++)
-		{
-			conn = cluster->active_list[i];
-			if (!conn->run_tag)
-				continue;
-
-			/* login finished, send query */
-			if (conn->cur->state == C_READY)
-				send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+		conn->cur->draining = 1;
+		conn->cur->drain_time = now;
+	}
+}
 
-			if (conn->cur->state != C_DONE)
-				pending++;
+/*
+ * Hedged requests.
+ *
+ * If READONLY function has not got result from partition in hedge_delay
+ * msecs, same query is sent to another endpoint of the partition.
+ * Whichever answers first is used, the other query is canceled and
+ * its connection drained.  Both run in the same event loop as others.
+ */
 
-			check_timeouts(func, cluster, conn, now.tv_sec);
-		}
+/* find endpoint for partition that is not used in this call */
+static ProxyConnection *
+choose_hedge(ProxyCluster *cluster, ProxyConnection *conn, time_t now)
+{
+	int			part = conn->part_num;
+	int			nrep = cluster->replica_count[part];
+	int			start,
+				i,
+				idx;
+	ProxyConnection *alt;
+
+	start = random() % (nrep + 1);
+	for (i = 0; i <= nrep; i++)
+	{
+		idx = (start + i) % (nrep + 1);
+		alt = (idx == 0) ? cluster->part_map[part] : cluster->replica_map[part][idx - 1];
+		if (alt == conn || alt->cur != NULL)
+			continue;
+		if (now - alt->down_time < PLPROXY_DOWN_RETRY)
+			continue;
+		return alt;
 	}
+	return NULL;
+}
 
-	/* review results, calculate total */
-	for (i = 0; i < cluster->active_count; i++)
+/* send unfinished queries to second endpoint */
+static void
+start_hedges(ProxyFunction *func, ProxyCluster *cluster, time_t now)
+{
+	ProxyConnection *conn,
+			   *alt;
+	int			i,
+				count = cluster->active_count;
+
+	for (i = 0; i < count; i++)
 	{
 		conn = cluster->active_list[i];
-
-		if ((conn->run_tag || conn->res)
-			&& !(conn->run_tag && conn->res))
-			plproxy_error(func, "run_tag does not match res");
-
-		if (!conn->run_tag)
+		if (!conn->run_tag || !conn->launched || conn->hedge_pair
+			|| conn->cur->state == C_DONE)
+			continue;
+		if (cluster->replica_count[conn->part_num] == 0)
 			continue;
 
-		if (conn->cur->state != C_DONE)
-			plproxy_error(func, "Unfinished connection");
-		if (conn->res == NULL)
-			plproxy_error(func, "Lost result");
-
-		err = PQresultStatus(conn->res);
-		if (err != PGRES_TUPLES_OK)
-			plproxy_error(func, "Remote error: %s",
-						  PQresultErrorMessage(conn->res));
+		alt = choose_hedge(cluster, conn, now);
+		if (!alt)
+			continue;
 
-		cluster->ret_total += PQntuples(conn->res);
+		plproxy_activate_connection(alt);
+		alt->run_tag = conn->run_tag;
+		alt->part_num = conn->part_num;
+		alt->split_params = conn->split_params;
+		memcpy(alt->param_values, conn->param_values, sizeof(alt->param_values));
+		memcpy(alt->param_lengths, conn->param_lengths, sizeof(alt->param_lengths));
+		memcpy(alt->param_formats, conn->param_formats, sizeof(alt->param_formats));
+		alt->hedge_pair = conn;
+		conn->hedge_pair = alt;
+
+		prepare_conn(func, alt);
+		if (alt->cur->state == C_READY)
+			send_query(func, alt, alt->param_values, alt->param_lengths, alt->param_formats);
 	}
 }
 
+/*
+ * Remove conn from current call, cancel its query
+ * and leave connection to be drained.
+ */
 static void
-remote_wait_for_cancel(ProxyFunction *func)
+cancel_conn(ProxyCluster *cluster, ProxyConnection *conn, time_t now)
 {
-	ProxyConnection *conn;
-	ProxyCluster *cluster = func->cur_cluster;
-	int			i,
-				pending;
-	struct timeval now;
+	PGcancel   *cancel;
+	char		errbuf[256];
 
-	/* now loop until all results are arrived */
-	while (1)
+	conn->run_tag = 0;
+	if (conn->res)
 	{
-		/* allow postgres to cancel processing */
-		CHECK_FOR_INTERRUPTS();
-
-		/* recheck */
-		pending = 0;
-		gettimeofday(&now, NULL);
-		for (i = 0; i < cluster->active_count; i++)
-		{
-			conn = cluster->active_list[i];
-			if (!conn->run_tag)
-				continue;
-
-			if (conn->cur->state == C_QUERY_READ)
-				pending++;
-			check_timeouts(func, cluster, conn, now.tv_sec);
-		}
-		if (!pending)
-			break;
-
-		/* wait for events */
-		poll_conns(func, cluster);
+		PQclear(conn->res);
+		conn->res = NULL;
 	}
 
-	/* review results, calculate total */
-	for (i = 0; i < cluster->active_count; i++)
-	{
-		conn = cluster->active_list[i];
+	/* still queued, state is from previous call */
+	if (!conn->launched)
+		return;
+
+	switch (conn->cur->state)
+	{
+		case C_QUERY_READ:
+			if (cluster->config.drain_timeout > 0 && !conn->cur->tuning)
+			{
+				cancel = PQgetCancel(conn->cur->db);
+				if (cancel)
+				{
+					if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+						elog(DEBUG1, "PL/Proxy: cancel failed: %s", errbuf);
+					PQfreeCancel(cancel);
+				}
+			}
+			/* fallthrough */
+		case C_QUERY_WRITE:
+			abandon_query(cluster, conn, now);
+			break;
+		case C_CONNECT_READ:
+		case C_CONNECT_WRITE:
+			plproxy_disconnect(conn->cur);
+			break;
+		case C_DONE:
+			conn->cur->state = C_READY;
+			break;
+		case C_NONE:
+		case C_READY:
+			break;
+	}
+}
+
+/* conn got result first, cancel the query on its pair */
+static void
+finish_hedge(ProxyCluster *cluster, ProxyConnection *conn, time_t now)
+{
+	ProxyConnection *other = conn->hedge_pair;
+
+	conn->hedge_pair = NULL;
+	other->hedge_pair = NULL;
+	cancel_conn(cluster, other, now);
+}
+
+/*
+ * Partial results for RUN ON ALL.
+ *
+ * With partial_deadline, partitions that have not answered by the
+ * deadline are canceled and the call returns rows from the others.
+ * Partitions that fail are also left out.  If less than
+ * partial_min_percent of partitions answered, the call fails.
+ */
+
+/* leave partition out of result */
+static void
+partial_drop(ProxyCluster *cluster, ProxyConnection *conn)
+{
+	cluster->missing_parts[cluster->missing_count++] = conn->part_num;
+}
+
+/* deadline reached, cancel unfinished partitions */
+static void
+partial_deadline(ProxyCluster *cluster, time_t now)
+{
+	ProxyConnection *conn;
+	int			i;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (!conn->run_tag)
+			continue;
+		if (conn->launched && conn->cur->state == C_DONE)
+			continue;
+
+		/* other one of hedged pair is counted */
+		if (conn->hedge_pair)
+		{
+			conn->hedge_pair->hedge_pair = NULL;
+			conn->hedge_pair = NULL;
+		}
+		else
+			partial_drop(cluster, conn);
+		cancel_conn(cluster, conn, now);
+	}
+}
+
+/* check minimum and tell which partitions are missing */
+static void
+partial_report(ProxyFunction *func, ProxyCluster *cluster, int total)
+{
+	StringInfoData buf;
+	int			answered = total - cluster->missing_count;
+	int			i;
+
+	if (answered * 100 < cluster->config.partial_min_percent * total)
+		plproxy_error(func, "only %d of %d partitions answered", answered, total);
+
+	initStringInfo(&buf);
+	for (i = 0; i < cluster->missing_count; i++)
+	{
+		if (i >= 20)
+		{
+			appendStringInfoString(&buf, ", ...");
+			break;
+		}
+		appendStringInfo(&buf, i ? ", %d" : "%d", cluster->missing_parts[i]);
+	}
+	elog(NOTICE, "PL/Proxy: %d of %d partitions did not answer: %s",
+		 cluster->missing_count, total, buf.data);
+	pfree(buf.data);
+}
+
+/*
+ * RUN ON ALL FIRST: conn returned rows, cancel all others.
+ */
+static void
+finish_first(ProxyCluster *cluster, ProxyConnection *winner, time_t now)
+{
+	ProxyConnection *conn;
+	int			i;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (conn == winner || !conn->run_tag)
+			continue;
+		if (conn->hedge_pair)
+		{
+			conn->hedge_pair->hedge_pair = NULL;
+			conn->hedge_pair = NULL;
+		}
+		cancel_conn(cluster, conn, now);
+	}
+
+	/* partitions left out do not matter anymore */
+	cluster->missing_count = 0;
+}
+
+/*
+ * RUN ON ALL FIRST: partition failed, but others may still have the rows.
+ * Error is raised only if none is found, see remote_execute().
+ */
+static void
+first_fail(ProxyCluster *cluster, ProxyConnection *conn, const char *msg)
+{
+	StringInfoData buf;
+
+	conn->run_tag = 0;
+	if (conn->res)
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+
+	/* other one of hedged pair is still running */
+	if (conn->hedge_pair)
+	{
+		conn->hedge_pair->hedge_pair = NULL;
+		conn->hedge_pair = NULL;
+		return;
+	}
+
+	elog(LOG, "PL/Proxy: partition %d: %s", conn->part_num, msg);
+	cluster->first_failed++;
+	if (cluster->first_error)
+		return;
+
+	initStringInfo(&buf);
+	appendStringInfo(&buf, "[%s] %s",
+					 PQdb(conn->cur->db) ? PQdb(conn->cur->db) : conn->connstr, msg);
+	while (buf.len > 0 && buf.data[buf.len - 1] == '\n')
+		buf.data[--buf.len] = 0;
+	cluster->first_error = buf.data;
+}
+
+/*
+ * Launch connections and send queries on tagged connections,
+ * at most max_parallel_connects connects and max_parallel_queries
+ * queries at a time.  Rest wait until running ones finish.
+ *
+ * Called repeatedly from event loop.
+ */
+static void
+dispatch_conns(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+	ProxyConnection *conn;
+	int			connects = 0,
+				queries = 0,
+				i,
+				count = cluster->active_count;	/* failover conns are launched already */
+
+	/* count running ones */
+	if (cf->max_parallel_connects > 0 || cf->max_parallel_queries > 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag || !conn->launched)
+				continue;
+			switch (conn->cur->state)
+			{
+				case C_CONNECT_READ:
+				case C_CONNECT_WRITE:
+					connects++;
+					break;
+				case C_QUERY_READ:
+				case C_QUERY_WRITE:
+					queries++;
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (!conn->run_tag)
+			continue;
+
+		/* check if conn is alive, and launch if not */
+		if (!conn->launched)
+		{
+			/* idle connection can be used without connect slot */
+			if (cf->max_parallel_connects > 0 && connects >= cf->max_parallel_connects
+				&& conn->cur->state != C_READY && conn->cur->state != C_DONE)
+				continue;
+
+			prepare_conn(func, conn);
+			if (!conn->run_tag)
+				continue;
+			if (conn->cur->state == C_CONNECT_READ || conn->cur->state == C_CONNECT_WRITE)
+				connects++;
+		}
+
+		/* if conn is ready, then send query away */
+		if (conn->cur->state == C_READY)
+		{
+			if (cf->max_parallel_queries > 0 && queries >= cf->max_parallel_queries)
+				continue;
+			send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+			queries++;
+		}
+	}
+}
+
+/* Run the query on all tagged connections in parallel */
+static void
+remote_execute(ProxyFunction *func)
+{
+	ExecStatusType err;
+	ProxyConnection *conn;
+	ProxyCluster *cluster = func->cur_cluster;
+	int			i,
+				pending = 0,
+				timeout;
+	struct timeval now,
+				start;
+	bool		hedge;
+	bool		partial;
+	bool		found = false;
+	int			total = 0;
+
+	/* hedge only once per call */
+	hedge = func->read_only && cluster->config.hedge_delay > 0
+		&& cluster->replica_total > 0;
+	gettimeofday(&start, NULL);
+
+	/* RUN ON ANY may move to other partition on connection failure */
+	cluster->failover_left = cluster->config.any_retries;
+
+	/* RUN ON ALL may leave out partitions, each conn at most once */
+	partial = func->run_type == R_ALL && cluster->config.partial_deadline > 0;
+	if (partial)
+	{
+		cluster->missing_parts = palloc((cluster->part_count + cluster->replica_total) * sizeof(int));
+		cluster->missing_count = 0;
+	}
+
+	/* either launch connection or send query */
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		if (cluster->active_list[i]->run_tag)
+			total++;
+	}
+	dispatch_conns(func, cluster);
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		if (cluster->active_list[i]->run_tag)
+			pending++;
+	}
+
+	/* now loop until all results are arrived */
+	while (pending)
+	{
+		/* allow postgres to cancel processing */
+		CHECK_FOR_INTERRUPTS();
+
+		/* wait for events, recheck timeouts even if none */
+		timeout = 1000;
+		gettimeofday(&now, NULL);
+		if (hedge && cluster->config.hedge_delay - elapsed_msecs(&start, &now) < timeout)
+			timeout = cluster->config.hedge_delay - elapsed_msecs(&start, &now);
+		if (partial && cluster->config.partial_deadline - elapsed_msecs(&start, &now) < timeout)
+			timeout = cluster->config.partial_deadline - elapsed_msecs(&start, &now);
+		if (timeout < 0)
+			timeout = 0;
+		poll_conns(func, cluster, timeout);
+
+		gettimeofday(&now, NULL);
+		if (partial && elapsed_msecs(&start, &now) >= cluster->config.partial_deadline)
+		{
+			partial = false;
+			partial_deadline(cluster, now.tv_sec);
+		}
+		if (hedge && elapsed_msecs(&start, &now) >= cluster->config.hedge_delay)
+		{
+			hedge = false;
+			start_hedges(func, cluster, now.tv_sec);
+		}
+
+		/* login finished or slots freed, send queries */
+		dispatch_conns(func, cluster);
+
+		/* recheck */
+		pending = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag)
+				continue;
+
+			/* still queued */
+			if (!conn->launched)
+			{
+				pending++;
+				continue;
+			}
+
+			/* first answer wins */
+			if (conn->cur->state == C_DONE && conn->hedge_pair)
+				finish_hedge(cluster, conn, now.tv_sec);
+
+			/* first rows win */
+			if (func->run_first && conn->cur->state == C_DONE
+				&& conn->res && PQntuples(conn->res) > 0)
+			{
+				finish_first(cluster, conn, now.tv_sec);
+				found = true;
+				pending = 0;
+				break;
+			}
+
+			if (conn->cur->state != C_DONE)
+				pending++;
+
+			check_timeouts(func, cluster, conn, now.tv_sec);
+		}
+	}
+
+	/* failed partitions may have had the rows */
+	if (func->run_first && !found && cluster->first_failed > 0)
+		plproxy_error(func, "no rows found, %d of %d partitions failed: %s",
+					  cluster->first_failed, total, cluster->first_error);
+
+	if (cluster->missing_count > 0)
+		partial_report(func, cluster, total);
+
+	/* review results, calculate total */
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+
+		if ((conn->run_tag || conn->res)
+			&& !(conn->run_tag && conn->res))
+			plproxy_error(func, "run_tag does not match res");
+
+		if (!conn->run_tag)
+			continue;
+
+		if (conn->cur->state != C_DONE)
+			plproxy_error(func, "Unfinished connection");
+		if (conn->res == NULL)
+			plproxy_error(func, "Lost result");
+
+		err = PQresultStatus(conn->res);
+		if (err != PGRES_TUPLES_OK)
+			plproxy_error(func, "Remote error: %s",
+						  PQresultErrorMessage(conn->res));
+
+		cluster->ret_total += PQntuples(conn->res);
+	}
+}
+
+static void
+remote_wait_for_cancel(ProxyFunction *func)
+{
+	ProxyConnection *conn;
+	ProxyCluster *cluster = func->cur_cluster;
+	int			i,
+				pending;
+	struct timeval now;
+
+	/* now loop until all results are arrived */
+	while (1)
+	{
+		/* allow postgres to cancel processing */
+		CHECK_FOR_INTERRUPTS();
+
+		/* recheck */
+		pending = 0;
+		gettimeofday(&now, NULL);
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag)
+				continue;
+
+			if (conn->cur->state == C_QUERY_READ)
+				pending++;
+			check_timeouts(func, cluster, conn, now.tv_sec);
+		}
+		if (!pending)
+			break;
+
+		/* wait for events */
+		poll_conns(func, cluster, 1000);
+	}
+
+	/* review results, calculate total */
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
 
 		if (!conn->run_tag)
 			continue;
 
-		if (conn->cur->state != C_DONE && conn->cur->state != C_NONE)
+		if (conn->cur->state != C_DONE && conn->cur->state != C_NONE
+			&& conn->cur->state != C_READY)
 			plproxy_error(func, "Unfinished connection: %d", conn->cur->state);
 		if (conn->res != NULL)
 		{
@@ -853,6 +1564,7 @@ remote_cancel(ProxyFunction *func)
 
 	if (cluster == NULL)
 		return;
+	cluster->failover_left = 0;
 
 	for (i = 0; i < cluster->active_count; i++)
 	{
@@ -892,14 +1604,286 @@ remote_cancel(ProxyFunction *func)
  * Tag & move tagged connections to active list
  */
 
+/*
+ * Pick connection for partition.  READONLY functions are spread
+ * randomly over primary and replicas, or only replicas with
+ * prefer_replicas.  Ones that failed to connect recently are skipped.
+ */
+static ProxyConnection *
+choose_endpoint(struct ProxyCluster *cluster, int part)
+{
+	ProxyConnection *primary = cluster->part_map[part];
+	ProxyConnection *conn;
+	int			nrep = cluster->replica_count[part];
+	int			first,
+				count,
+				start,
+				i,
+				idx;
+	time_t		now;
+
+	if (nrep == 0 || !cluster->cur_func || !cluster->cur_func->read_only)
+		return primary;
+
+	/* SPLIT tags partition many times, stay on same connection */
+	if (primary->run_tag)
+		return primary;
+	for (i = 0; i < nrep; i++)
+	{
+		if (cluster->replica_map[part][i]->run_tag)
+			return cluster->replica_map[part][i];
+	}
+
+	/* index 0 is primary */
+	first = (cluster->config.prefer_replicas > 0) ? 1 : 0;
+	count = nrep + 1 - first;
+	start = random() % count;
+	now = time(NULL);
+
+	for (i = 0; i < count; i++)
+	{
+		idx = first + (start + i) % count;
+		conn = (idx == 0) ? primary : cluster->replica_map[part][idx - 1];
+		if (now - conn->down_time >= PLPROXY_DOWN_RETRY)
+			return conn;
+	}
+
+	/* all are failing, primary is as good as any */
+	return primary;
+}
+
 static void tag_part(struct ProxyCluster *cluster, int i, int tag)
 {
-	ProxyConnection *conn = cluster->part_map[i];
+	ProxyConnection *conn = choose_endpoint(cluster, i);
 
 	if (!conn->run_tag)
 		plproxy_activate_connection(conn);
 
 	conn->run_tag = tag;
+	conn->part_num = i;
+}
+
+static int
+part_weight(ProxyConfig *cf, int part)
+{
+	if (part < cf->part_weight_count)
+		return cf->part_weights[part];
+	return 1;
+}
+
+/*
+ * RUN ON ANY: pick partition by weight.  If all weights are equal,
+ * it is same as uniform random choice.
+ */
+static int
+weighted_partition(ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+	int64		total = 0,
+				n;
+	int			i;
+
+	if (!cf->part_weights)
+		return random() & cluster->part_mask;
+
+	for (i = 0; i < cluster->part_count; i++)
+		total += part_weight(cf, i);
+	if (total <= 0)
+		return random() & cluster->part_mask;
+
+	n = random() % total;
+	for (i = 0; i < cluster->part_count; i++)
+	{
+		n -= part_weight(cf, i);
+		if (n < 0)
+			break;
+	}
+	return i;
+}
+
+/* expected cost of running on partition, lower is better */
+static double
+partition_cost(ProxyCluster *cluster, int part, time_t now)
+{
+	ProxyConnection *conn = cluster->part_map[part];
+
+	if (now - conn->down_time < PLPROXY_DOWN_RETRY)
+		return 1e12;
+
+	/* unknown or old, let it be measured again */
+	if (now - conn->latency_time >= PLPROXY_LATENCY_RESET)
+		return 0;
+	return conn->latency;
+}
+
+/*
+ * RUN ON ANY: pick two partitions by weight and take the one that
+ * has answered faster lately ("power of two choices").  Slow or
+ * overloaded partitions get less load, but still some, so recovery
+ * is noticed.
+ */
+static int
+choose_any_partition(ProxyCluster *cluster)
+{
+	int			a,
+				b;
+	time_t		now;
+
+	if (cluster->part_count == 1)
+		return 0;
+
+	a = weighted_partition(cluster);
+	b = weighted_partition(cluster);
+	if (a == b)
+		return a;
+
+	now = time(NULL);
+	if (partition_cost(cluster, b, now) < partition_cost(cluster, a, now))
+		return b;
+	return a;
+}
+
+/*
+ * RUN ON ANY: move query to another partition after connection failure.
+ *
+ * Done only if the query may not have reached the failed connection,
+ * or function is READONLY, so running it twice does no harm.
+ * Returns false if caller should raise the error.
+ */
+static bool
+any_failover(ProxyFunction *func, ProxyConnection *conn,
+			 const char *desc, bool query_sent)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection *alt = NULL;
+	time_t		now = time(NULL);
+	char		msg[256];
+	int			start,
+				part,
+				i;
+
+	/* prewarm: real query will retry */
+	if (cluster->prewarming)
+	{
+		elog(WARNING, "PL/Proxy: prewarm of [%s] failed: %s",
+			 PQdb(conn->cur->db) ? PQdb(conn->cur->db) : conn->connstr, desc);
+		conn->run_tag = 0;
+		conn->down_time = now;
+		plproxy_disconnect(conn->cur);
+		return true;
+	}
+
+	/* hedged query still runs on other conn */
+	if (conn->hedge_pair)
+	{
+		conn->hedge_pair->hedge_pair = NULL;
+		conn->hedge_pair = NULL;
+		conn->run_tag = 0;
+		conn->down_time = now;
+		if (conn->res)
+		{
+			PQclear(conn->res);
+			conn->res = NULL;
+		}
+		plproxy_disconnect(conn->cur);
+		return true;
+	}
+
+	/* RUN ON ALL FIRST, other partitions may have the rows */
+	if (func->run_first && conn->run_tag)
+	{
+		snprintf(msg, sizeof(msg), "%s: %s", desc,
+				 conn->cur->db ? PQerrorMessage(conn->cur->db) : "");
+		first_fail(cluster, conn, msg);
+		conn->down_time = now;
+		plproxy_disconnect(conn->cur);
+		return true;
+	}
+
+	/* partial result, go on without it */
+	if (cluster->missing_parts && conn->run_tag)
+	{
+		elog(LOG, "PL/Proxy: partition %d: %s, leaving it out", conn->part_num, desc);
+		partial_drop(cluster, conn);
+		conn->run_tag = 0;
+		conn->down_time = now;
+		if (conn->res)
+		{
+			PQclear(conn->res);
+			conn->res = NULL;
+		}
+		plproxy_disconnect(conn->cur);
+		return true;
+	}
+
+	if (func->run_type != R_ANY || cluster->failover_left <= 0)
+		return false;
+	if (conn->cur->state == C_DONE)
+		return false;
+	if (query_sent && !func->read_only)
+		return false;
+
+	conn->down_time = now;
+
+	start = random() % cluster->part_count;
+	for (i = 0; i < cluster->part_count; i++)
+	{
+		part = (start + i) % cluster->part_count;
+		if (part_weight(&cluster->config, part) <= 0)
+			continue;
+		alt = choose_endpoint(cluster, part);
+		if (alt != conn && alt->cur == NULL
+			&& now - alt->down_time >= PLPROXY_DOWN_RETRY)
+			break;
+		alt = NULL;
+	}
+	if (!alt)
+		return false;
+
+	elog(LOG, "PL/Proxy: partition %d: %s, retrying on partition %d",
+		 conn->part_num, desc, part);
+	cluster->failover_left--;
+
+	/* drop failed conn from this call */
+	plproxy_disconnect(conn->cur);
+	if (conn->res)
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+
+	plproxy_activate_connection(alt);
+	alt->run_tag = conn->run_tag;
+	alt->part_num = part;
+	alt->split_params = conn->split_params;
+	memcpy(alt->param_values, conn->param_values, sizeof(alt->param_values));
+	memcpy(alt->param_lengths, conn->param_lengths, sizeof(alt->param_lengths));
+	memcpy(alt->param_formats, conn->param_formats, sizeof(alt->param_formats));
+	conn->run_tag = 0;
+
+	prepare_conn(func, alt);
+	if (alt->cur->state == C_READY)
+		send_query(func, alt, alt->param_values, alt->param_lengths, alt->param_formats);
+	return true;
+}
+
+/*
+ * Connection-level failure: count it in partition health map,
+ * then see if the call can continue elsewhere.
+ *
+ * Returns false if caller should raise the error.
+ */
+static bool
+conn_failed(ProxyFunction *func, ProxyConnection *conn,
+			const char *desc, bool query_sent)
+{
+	char		msg[256];
+
+	snprintf(msg, sizeof(msg), "%s: %s", desc,
+			 conn->cur->db ? PQerrorMessage(conn->cur->db) : "");
+	plproxy_health_failure(conn->health_key, msg);
+
+	return any_failover(func, conn, desc, query_sent);
 }
 
 /*
@@ -1004,7 +1988,7 @@ tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 			tag_part(cluster, i, tag);
 			break;
 		case R_ANY:
-			i = random() & cluster->part_mask;
+			i = choose_any_partition(cluster);
 			tag_part(cluster, i, tag);
 			break;
 		default:
@@ -1208,6 +2192,12 @@ plproxy_clean_results(ProxyCluster *cluster)
 
 	cluster->ret_total = 0;
 	cluster->ret_cur_conn = 0;
+	cluster->failover_left = 0;
+	cluster->missing_parts = NULL;
+	cluster->first_failed = 0;
+	cluster->first_error = NULL;
+	cluster->missing_count = 0;
+	cluster->prewarming = false;
 
 	for (i = 0; i < cluster->active_count; i++)
 	{
@@ -1219,7 +2209,11 @@ plproxy_clean_results(ProxyCluster *cluster)
 		}
 		conn->pos = 0;
 		conn->run_tag = 0;
+		conn->launched = false;
+		conn->hedge_pair = NULL;
 		conn->bstate = NULL;
+		if (conn->cur && conn->cur->in_use > 0)
+			conn->cur->in_use--;
 		conn->cur = NULL;
 		cluster->active_list[i] = NULL;
 	}
@@ -1230,19 +2224,301 @@ plproxy_clean_results(ProxyCluster *cluster)
 	/* conn state checks are done in prepare_conn */
 }
 
+/*
+ * Rolling recycle for connection_lifetime.
+ *
+ * Connection is replaced at random point between 60% and 90% of
+ * its lifetime, so connections opened together do not expire together.
+ * The replacement is opened next to the old connection and moved forward
+ * without waiting whenever the state is looked at, the old one stays in use
+ * until the replacement is ready.  If it does not get ready in time,
+ * the old connection is dropped on lifetime as before.
+ */
+
+/* close unfinished replacement */
+static void
+drop_replacement(ProxyConnectionState *cur)
+{
+	if (cur->next_db)
+	{
+		PQfinish(cur->next_db);
+		open_conn_count--;
+	}
+	cur->next_db = NULL;
+}
+
+/* returns true if replacement is connected */
+static bool
+poll_replacement(ProxyConnectionState *cur)
+{
+	struct pollfd pfd;
+
+	/* PQconnectPoll must be called only when socket is ready */
+	pfd.fd = PQsocket(cur->next_db);
+	pfd.events = cur->next_wait_write ? POLLOUT : POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) <= 0)
+		return false;
+
+	switch (PQconnectPoll(cur->next_db))
+	{
+		case PGRES_POLLING_WRITING:
+			cur->next_wait_write = true;
+			return false;
+		case PGRES_POLLING_READING:
+			cur->next_wait_write = false;
+			return false;
+		case PGRES_POLLING_OK:
+			return true;
+		case PGRES_POLLING_ACTIVE:
+		case PGRES_POLLING_FAILED:
+			break;
+	}
+
+	elog(LOG, "PL/Proxy: replacement connection to [%s] failed: %s",
+		 PQdb(cur->next_db), PQerrorMessage(cur->next_db));
+	drop_replacement(cur);
+	return false;
+}
+
+void
+plproxy_recycle_connection(ProxyConnection *conn, ProxyConnectionState *cur, struct timeval *now)
+{
+	ProxyConfig *cf = &conn->cluster->config;
+	int64		recycle_age;
+
+	if (cf->connection_lifetime <= 0 || !cur->db)
+		return;
+	if (cur->state != C_READY && cur->state != C_DONE)
+		return;
+	if (PQstatus(cur->db) != CONNECTION_OK)
+		return;
+
+	if (!cur->next_db)
+	{
+		/* msecs */
+		recycle_age = (int64) cf->connection_lifetime * (600 + cur->recycle_jitter * 3 / 10);
+		if (elapsed_msecs(&cur->connect_time, now) < recycle_age)
+			return;
+		if (now->tv_sec - cur->next_connect_time.tv_sec < PLPROXY_RECYCLE_RETRY)
+			return;
+		if (plproxy_max_connections > 0 && open_conn_count >= plproxy_max_connections)
+			return;
+
+		cur->next_connect_time = *now;
+		cur->next_wait_write = true;
+		cur->next_db = connect_start(conn, cur->connstr);
+		if (!cur->next_db)
+			return;
+		open_conn_count++;
+		if (PQstatus(cur->next_db) == CONNECTION_BAD)
+			drop_replacement(cur);
+		return;
+	}
+
+	if (!poll_replacement(cur))
+		return;
+
+	/* switch to new connection */
+	PQfinish(cur->db);
+	open_conn_count--;
+	cur->db = cur->next_db;
+	cur->next_db = NULL;
+	cur->state = C_READY;
+	cur->connect_time = cur->next_connect_time;
+	cur->same_ver = 0;
+	cur->tuning = 0;
+	cur->role[0] = 0;
+	cur->stmt_timeout = 0;
+	cur->recycle_jitter = random() % 1000;
+
+	PQsetNoticeReceiver(cur->db, handle_notice, cur);
+	setup_keepalive(cf, cur->db);
+}
+
+/*
+ * Draining: when call fails, queries still running on other
+ * partitions are not waited for.  Instead of dropping their
+ * connections, the results are skipped later, either when the
+ * connection is used again or during maintenance.  If the query
+ * does not finish in drain_timeout, the connection is dropped.
+ */
+static void
+drain_abandoned_queries(ProxyCluster *cluster)
+{
+	ProxyConnection *conn;
+	time_t		now = time(NULL);
+	int			i;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (conn->cur)
+			abandon_query(cluster, conn, now);
+	}
+}
+
+/* skip results of abandoned query without waiting */
+void
+plproxy_drain_connection(ProxyConfig *cf, ProxyConnectionState *cur, time_t now)
+{
+	PGresult   *res;
+	int			flush_res;
+
+	if (now - cur->drain_time >= cf->drain_timeout)
+		goto failed;
+
+	if (cur->state == C_QUERY_WRITE)
+	{
+		flush_res = PQflush(cur->db);
+		if (flush_res < 0)
+			goto failed;
+		if (flush_res > 0)
+			return;
+		cur->state = C_QUERY_READ;
+	}
+
+	if (!PQconsumeInput(cur->db))
+		goto failed;
+	while (!PQisBusy(cur->db))
+	{
+		res = PQgetResult(cur->db);
+		tuning_result(cur, res);
+		if (res == NULL)
+		{
+			cur->state = C_READY;
+			cur->draining = 0;
+			cur->tuning = 0;
+			return;
+		}
+		PQclear(res);
+	}
+	return;
+
+failed:
+	plproxy_disconnect(cur);
+}
+
 /* Drop one connection */
 void plproxy_disconnect(ProxyConnectionState *cur)
 {
+	cur->draining = 0;
+	drop_replacement(cur);
 	if (cur->db)
+	{
 		PQfinish(cur->db);
+		open_conn_count--;
+	}
 	cur->db = NULL;
 	cur->state = C_NONE;
 	cur->tuning = 0;
-	cur->connect_time = 0;
+	memset(&cur->connect_time, 0, sizeof(cur->connect_time));
 	cur->query_time = 0;
 	cur->same_ver = 0;
 	cur->tuning = 0;
 	cur->waitCancel = 0;
+	cur->role[0] = 0;
+	cur->stmt_timeout = 0;
+}
+
+/*
+ * Open connections to all partitions for current user,
+ * at most cf->prewarm of them in parallel.
+ *
+ * Done once per user after each partition list load,
+ * so following queries find connections ready.  Uses the usual
+ * connect handling, failures are counted in health map but
+ * are not fatal, see any_failover().
+ */
+static void
+prewarm_cluster(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ConnUserInfo *uinfo = cluster->cur_userinfo;
+	ProxyConfig *cf = &cluster->config;
+	ProxyConnection *conn;
+	struct timeval now;
+	int			i,
+				running,
+				waiting;
+
+	if (cf->prewarm <= 0 || cluster->fake_cluster)
+		return;
+	if (uinfo->prewarm_seq == cluster->topology_seq)
+		return;
+
+	/* dont retry on failure */
+	uinfo->prewarm_seq = cluster->topology_seq;
+
+	/* activate each connection once */
+	for (i = 0; i < cluster->part_count; i++)
+		tag_part(cluster, i, 1);
+	cluster->prewarming = true;
+
+	while (1)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* count connects in progress */
+		running = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (conn->run_tag && conn->launched)
+				running++;
+		}
+
+		/* launch new connections, within limit */
+		waiting = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag || conn->launched)
+				continue;
+
+			/* already open */
+			if (conn->cur->state != C_NONE)
+			{
+				conn->run_tag = 0;
+				continue;
+			}
+			if (running >= cf->prewarm)
+			{
+				waiting++;
+				continue;
+			}
+
+			/* dont go over plproxy.max_connections for prewarm */
+			if (!reserve_connection())
+			{
+				conn->run_tag = 0;
+				continue;
+			}
+
+			prepare_conn(func, conn);
+			if (conn->run_tag)
+				running++;
+		}
+		if (running == 0 && waiting == 0)
+			break;
+
+		poll_conns(func, cluster, 1000);
+
+		/* logged in or timed out */
+		gettimeofday(&now, NULL);
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag || !conn->launched)
+				continue;
+			if (conn->cur->state == C_READY)
+				conn->run_tag = 0;
+			else
+				check_timeouts(func, cluster, conn, now.tv_sec);
+		}
+	}
+
+	/* release active list */
+	plproxy_clean_results(cluster);
 }
 
 /* Select partitions and execute query on them */
@@ -1257,10 +2533,14 @@ plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
 	{
 		func->cur_cluster->busy = true;
 		func->cur_cluster->cur_func = func;
+		func->cur_cluster->exec_id = ++exec_seq;
 
 		/* clean old results */
 		plproxy_clean_results(func->cur_cluster);
 
+		/* open all connections first, if requested */
+		prewarm_cluster(func, func->cur_cluster);
+
 		/* tag the partitions and prepare per-partition parameters */
 		prepare_and_tag_partitions(func, fcinfo);
 
@@ -1277,6 +2557,8 @@ plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
 
 		if (geterrcode() == ERRCODE_QUERY_CANCELED)
 			remote_cancel(func);
+		else
+			drain_abandoned_queries(func->cur_cluster);
 
 		/* plproxy_remote_error() cannot clean itself, do it here */
 		plproxy_clean_results(func->cur_cluster);
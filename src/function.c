@@ -47,7 +47,7 @@ typedef struct
 static HTAB *fn_cache = NULL;
 
 /*
- * During compilation function is linked here.
+ * During preparation of local queries function is linked here.
  *
  * This avoids memleaks when throwing errors.
  */
@@ -207,6 +207,26 @@ fn_cache_delete(ProxyFunction *func)
 	Assert(hentry != NULL);
 }
 
+/*
+ * Cluster is about to be freed, drop references to it.
+ */
+void
+plproxy_function_forget_cluster(ProxyCluster *cluster)
+{
+	HASH_SEQ_STATUS seq;
+	HashEntry  *hentry;
+
+	if (!fn_cache)
+		return;
+
+	hash_seq_init(&seq, fn_cache);
+	while ((hentry = hash_seq_search(&seq)) != NULL)
+	{
+		if (hentry->function->cur_cluster == cluster)
+			hentry->function->cur_cluster = NULL;
+	}
+}
+
 /* check if function returns untyped RECORD which needs the AS clause */
 static bool
 fn_returns_dynamic_record(HeapTuple proc_tuple)
@@ -263,9 +283,20 @@ fn_new(HeapTuple proc_tuple)
 static void
 fn_delete(ProxyFunction *func, bool in_cache)
 {
+	int			i;
+
 	if (in_cache)
 		fn_cache_delete(func);
 
+	/* release shared type info */
+	for (i = 0; i < func->arg_count; i++)
+		plproxy_free_type(func->arg_types[i]);
+	plproxy_free_type(func->ret_scalar);
+	if (func->ret_composite)
+		plproxy_free_composite(func->ret_composite);
+	for (i = 0; i < func->record_variant_count; i++)
+		plproxy_free_composite(func->record_variants[i].ret_composite);
+
 	/* free cached plans */
 	plproxy_query_freeplan(func->hash_sql);
 	plproxy_query_freeplan(func->cluster_sql);
@@ -414,6 +445,7 @@ fn_get_return_type(ProxyFunction *func,
 			func->ret_composite = plproxy_composite_info(func, ret_tup);
 			natts = func->ret_composite->tupdesc->natts;
 			func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
+			func->result_map_nfields = -1;
 			break;
 		case TYPEFUNC_SCALAR:
 			func->ret_scalar = plproxy_find_type_info(func, ret_oid, 0);
@@ -427,6 +459,76 @@ fn_get_return_type(ProxyFunction *func,
 	}
 }
 
+/*
+ * Untyped RECORD: look for result shape used before.
+ *
+ * On success the variant becomes current and current one
+ * is stored as most recently used variant.
+ */
+static bool
+fn_use_record_variant(ProxyFunction *func, TupleDesc tupdesc)
+{
+	ProxyRecordVariant *list = func->record_variants;
+	ProxyRecordVariant found;
+	int			i;
+
+	for (i = 0; i < func->record_variant_count; i++)
+	{
+		if (equalTupleDescs(tupdesc, list[i].ret_composite->tupdesc))
+			break;
+	}
+	if (i >= func->record_variant_count)
+		return false;
+
+	found = list[i];
+	memmove(list + 1, list, i * sizeof(*list));
+	list[0].ret_composite = func->ret_composite;
+	list[0].remote_sql = func->remote_sql;
+	list[0].result_map = func->result_map;
+	list[0].result_map_nfields = func->result_map_nfields;
+
+	func->ret_composite = found.ret_composite;
+	func->remote_sql = found.remote_sql;
+	func->result_map = found.result_map;
+	func->result_map_nfields = found.result_map_nfields;
+	return true;
+}
+
+/*
+ * Untyped RECORD: move current result shape to variant list,
+ * dropping least recently used one if full.
+ */
+static void
+fn_save_record_variant(ProxyFunction *func)
+{
+	ProxyRecordVariant *list;
+	int			n;
+
+	if (func->record_variants == NULL)
+		func->record_variants = plproxy_func_alloc(func,
+			PLPROXY_RECORD_VARIANTS * sizeof(ProxyRecordVariant));
+	list = func->record_variants;
+
+	n = func->record_variant_count;
+	if (n == PLPROXY_RECORD_VARIANTS)
+	{
+		n--;
+		plproxy_free_composite(list[n].ret_composite);
+		plproxy_query_free(list[n].remote_sql);
+		pfree(list[n].result_map);
+	}
+	memmove(list + 1, list, n * sizeof(*list));
+	list[0].ret_composite = func->ret_composite;
+	list[0].remote_sql = func->remote_sql;
+	list[0].result_map = func->result_map;
+	list[0].result_map_nfields = func->result_map_nfields;
+	func->record_variant_count = n + 1;
+
+	func->ret_composite = NULL;
+	func->remote_sql = NULL;
+	func->result_map = NULL;
+}
+
 /*
  * Check if cached ->ret_composite is valid, refresh if needed.
  */
@@ -438,6 +540,7 @@ fn_refresh_record(FunctionCallInfo fcinfo,
 
 	TypeFuncClass rtc;
 	TupleDesc tuple_current, tuple_cached;
+	ProxyComposite *composite;
 	MemoryContext old_ctx;
 	Oid tuple_oid;
 	int natts;
@@ -451,20 +554,33 @@ fn_refresh_record(FunctionCallInfo fcinfo,
 	if (equalTupleDescs(tuple_current, tuple_cached))
 		return;
 
+	/* untyped RECORD may switch between known shapes */
+	if (func->dynamic_record && fn_use_record_variant(func, tuple_current))
+		return;
+
 	/* move to function context */
 	old_ctx = MemoryContextSwitchTo(func->ctx);
 	tuple_current = CreateTupleDescCopy(tuple_current);
 	MemoryContextSwitchTo(old_ctx);
 
-	/* release old data */
-	plproxy_free_composite(func->ret_composite);
-	pfree(func->result_map);
-	pfree(func->remote_sql);
+	/* construct new type info before touching the old one */
+	composite = plproxy_composite_info(func, tuple_current);
+
+	/* keep or release old data */
+	if (func->dynamic_record)
+		fn_save_record_variant(func);
+	else
+	{
+		plproxy_free_composite(func->ret_composite);
+		pfree(func->result_map);
+		pfree(func->remote_sql);
+	}
 
 	/* construct new data */
-	func->ret_composite = plproxy_composite_info(func, tuple_current);
+	func->ret_composite = composite;
 	natts = func->ret_composite->tupdesc->natts;
 	func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
+	func->result_map_nfields = -1;
 	func->remote_sql = plproxy_standard_query(func, true);
 }
 
@@ -472,7 +588,10 @@ fn_refresh_record(FunctionCallInfo fcinfo,
  * Show part of compilation -- get source and parse
  *
  * When called from the validator, validate_only is true, but there is no
- * fcinfo.
+ * fcinfo.  Then the function is only checked and freed, NULL is returned.
+ *
+ * On error the half-built function is freed here, so shared type
+ * info it has taken is released.
  */
 ProxyFunction *
 plproxy_compile(FunctionCallInfo fcinfo,
@@ -490,31 +609,45 @@ plproxy_compile(FunctionCallInfo fcinfo,
 
 	f = fn_new(proc_tuple);
 
-	/* keep reference in case of error half-way */
-	if (!validate_only)
-		partial_func = f;
-
-	/* info from system tables */
-	fn_set_name(f, proc_tuple);
-	/*
-	 * Cannot check return type in validator, because there is no call info to
-	 * resolve polymorphic types against.
-	 */
-	if (!validate_only)
-		fn_get_return_type(f, fcinfo, proc_tuple);
-	fn_get_arguments(f, proc_tuple);
-
-	/* parse body */
-	fn_parse(f, proc_tuple);
-
-	if (f->dynamic_record && f->remote_sql)
-		plproxy_error(f, "SELECT statement not allowed for dynamic RECORD functions");
+	PG_TRY();
+	{
+		/* info from system tables */
+		fn_set_name(f, proc_tuple);
+		/*
+		 * Cannot check return type in validator, because there is no call info to
+		 * resolve polymorphic types against.
+		 */
+		if (!validate_only)
+			fn_get_return_type(f, fcinfo, proc_tuple);
+		fn_get_arguments(f, proc_tuple);
+
+		/* parse body */
+		fn_parse(f, proc_tuple);
+
+		if (f->dynamic_record && f->remote_sql)
+			plproxy_error(f, "SELECT statement not allowed for dynamic RECORD functions");
+
+		f->needs_spi = (f->hash_sql || f->cluster_sql || f->connect_sql);
+
+		/* sanity check */
+		if (f->run_type == R_ALL && !f->run_first && (fcinfo
+									 ? !fcinfo->flinfo->fn_retset
+									 : !get_func_retset(HeapTupleGetOid(proc_tuple))))
+			plproxy_error(f, "RUN ON ALL requires set-returning function");
+	}
+	PG_CATCH();
+	{
+		fn_delete(f, false);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-	/* sanity check */
-	if (f->run_type == R_ALL && (fcinfo
-								 ? !fcinfo->flinfo->fn_retset
-								 : !get_func_retset(HeapTupleGetOid(proc_tuple))))
-		plproxy_error(f, "RUN ON ALL requires set-returning function");
+	/* validator does not keep it */
+	if (validate_only)
+	{
+		fn_delete(f, false);
+		return NULL;
+	}
 
 	return f;
 }
@@ -558,6 +691,9 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 	{
 		f = plproxy_compile(fcinfo, proc_tuple, false);
 
+		/* keep reference in case of error half-way */
+		partial_func = f;
+
 		/* create SELECT stmt if not specified */
 		if (f->remote_sql == NULL)
 			f->remote_sql = plproxy_standard_query(f, true);
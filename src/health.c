@@ -0,0 +1,482 @@
+/*
+ * PL/Proxy - easy access to partitioned database.
+ *
+ * Copyright (c) 2006 Sven Suursoho, Skype Technologies OÜ
+ * Copyright (c) 2007 Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Partition health map with circuit breaker.
+ *
+ * Connection failures are counted per partition host+port+dbname.
+ * After plproxy.breaker_threshold consecutive failures the breaker
+ * opens and new connections are refused without trying for
+ * plproxy.breaker_timeout seconds.  Then one backend is let through
+ * to probe (half-open), its success closes the breaker.
+ *
+ * If plproxy is in shared_preload_libraries, the map is in shared
+ * memory and all backends learn from each other's failures.
+ * Otherwise each backend keeps its own map.  Shared map is protected
+ * by LWLock, so lookups from many backends do not block each other.
+ */
+
+#include "plproxy.h"
+
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/timestamp.h>
+
+/* shared map needs named LWLock tranche */
+#if PG_VERSION_NUM >= 90600
+#define HEALTH_SHMEM
+#endif
+
+#define HEALTH_KEY_LEN		128
+#define HEALTH_ERR_LEN		128
+
+/* how many slots to look at for a key */
+#define HEALTH_PROBES		32
+
+enum HealthState {
+	HEALTH_CLOSED = 0,
+	HEALTH_OPEN,
+	HEALTH_HALF_OPEN
+};
+
+static const char *health_state_names[] = { "closed", "open", "half-open" };
+
+/* One partition, created on first failure */
+typedef struct HealthEntry {
+	uint32		hash;			/* 0 = unused slot */
+	char		key[HEALTH_KEY_LEN];
+	int			state;
+	int			failures;		/* Consecutive failures */
+	time_t		last_failure;
+	time_t		retry_time;		/* open: when to probe, half-open: probe expires */
+	int			probe_pid;		/* Backend doing the probe */
+	char		last_error[HEALTH_ERR_LEN];
+} HealthEntry;
+
+typedef struct HealthMap {
+#ifdef HEALTH_SHMEM
+	LWLock	   *lock;			/* Used only in shared memory */
+#endif
+	int			nslots;
+	HealthEntry	slots[1];
+} HealthMap;
+
+static HealthMap *shared_map = NULL;
+static HealthMap *local_map = NULL;
+
+#ifdef HEALTH_SHMEM
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#endif
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size
+health_map_size(void)
+{
+	return offsetof(HealthMap, slots) + PLPROXY_HEALTH_SLOTS * sizeof(HealthEntry);
+}
+
+static HealthMap *
+get_map(void)
+{
+	if (shared_map)
+		return shared_map;
+	if (!local_map)
+	{
+		local_map = MemoryContextAllocZero(TopMemoryContext, health_map_size());
+		local_map->nslots = PLPROXY_HEALTH_SLOTS;
+	}
+	return local_map;
+}
+
+/* shared lock is enough when entries are not changed */
+static void
+lock_map(HealthMap *map, bool exclusive)
+{
+#ifdef HEALTH_SHMEM
+	if (map == shared_map)
+		LWLockAcquire(map->lock, exclusive ? LW_EXCLUSIVE : LW_SHARED);
+#endif
+}
+
+static void
+unlock_map(HealthMap *map)
+{
+#ifdef HEALTH_SHMEM
+	if (map == shared_map)
+		LWLockRelease(map->lock);
+#endif
+}
+
+/* FNV-1a, never 0 */
+static uint32
+health_hash(const char *key)
+{
+	uint32		h = 2166136261u;
+
+	while (*key)
+	{
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return h ? h : 1;
+}
+
+/*
+ * Find entry for key, must be called with lock held,
+ * exclusive one if creating.
+ *
+ * If creating and the slots for key are full, healthy
+ * entry is reused, then the key is not tracked.
+ */
+static HealthEntry *
+find_entry(HealthMap *map, const char *key, uint32 hash, bool create)
+{
+	HealthEntry *e,
+			   *free_slot = NULL,
+			   *reuse = NULL;
+	int			i;
+
+	for (i = 0; i < HEALTH_PROBES; i++)
+	{
+		e = &map->slots[(hash + i) % map->nslots];
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+			return e;
+		if (e->hash == 0)
+		{
+			if (!free_slot)
+				free_slot = e;
+		}
+		else if (!reuse && e->state == HEALTH_CLOSED && e->failures == 0)
+			reuse = e;
+	}
+	if (!create)
+		return NULL;
+
+	e = free_slot ? free_slot : reuse;
+	if (e)
+	{
+		memset(e, 0, sizeof(*e));
+		e->hash = hash;
+		snprintf(e->key, sizeof(e->key), "%s", key);
+	}
+	return e;
+}
+
+#ifdef HEALTH_SHMEM
+static void
+health_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared_map = ShmemInitStruct("PL/Proxy partition health", health_map_size(), &found);
+	if (!found)
+	{
+		memset(shared_map, 0, health_map_size());
+		shared_map->lock = &(GetNamedLWLockTranche("plproxy_health"))->lock;
+		shared_map->nslots = PLPROXY_HEALTH_SLOTS;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+#endif
+
+#if PG_VERSION_NUM >= 150000
+static void
+health_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+	RequestAddinShmemSpace(health_map_size());
+	RequestNamedLWLockTranche("plproxy_health", 1);
+}
+#endif
+
+/*
+ * Module load: reserve shared memory if preloaded.
+ */
+void
+plproxy_health_init(void)
+{
+#ifdef HEALTH_SHMEM
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = health_shmem_request;
+#else
+	RequestAddinShmemSpace(health_map_size());
+	RequestNamedLWLockTranche("plproxy_health", 1);
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = health_shmem_startup;
+#endif
+}
+
+/*
+ * Return health key for connect string: host, port and dbname.
+ *
+ * User and password are left out, all users see same partition.
+ * Returns NULL if connect string cannot be parsed.  Result is palloc'd.
+ */
+char *
+plproxy_health_key(const char *connstr)
+{
+#if PG_VERSION_NUM >= 80400
+	PQconninfoOption *opts,
+			   *opt;
+	char	   *errmsg = NULL;
+	StringInfoData buf;
+	char	   *result;
+
+	opts = PQconninfoParse(connstr, &errmsg);
+	if (opts == NULL)
+	{
+		if (errmsg)
+			PQfreemem(errmsg);
+		return NULL;
+	}
+
+	initStringInfo(&buf);
+	for (opt = opts; opt->keyword; opt++)
+	{
+		if (opt->val == NULL || opt->val[0] == 0)
+			continue;
+		if (strcmp(opt->keyword, "host") == 0
+			|| strcmp(opt->keyword, "hostaddr") == 0
+			|| strcmp(opt->keyword, "port") == 0
+			|| strcmp(opt->keyword, "dbname") == 0)
+		{
+			if (buf.len > 0)
+				appendStringInfoChar(&buf, ' ');
+			appendStringInfo(&buf, "%s=%s", opt->keyword, opt->val);
+		}
+	}
+	PQconninfoFree(opts);
+
+	/* same truncation as stored key */
+	if (buf.len >= HEALTH_KEY_LEN)
+		buf.data[HEALTH_KEY_LEN - 1] = 0;
+	result = pstrdup(buf.data);
+	pfree(buf.data);
+	return result;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Check if new connection to partition may be tried.
+ *
+ * When breaker is open and retry time has come, the caller
+ * becomes the probe and gets true, others get false until
+ * the probe reports back or its time runs out.
+ */
+bool
+plproxy_health_allow(const char *key)
+{
+	HealthMap  *map;
+	HealthEntry *e;
+	time_t		now;
+	uint32		hash;
+	bool		ok = true;
+	bool		closed;
+
+	if (!key || plproxy_breaker_threshold <= 0)
+		return true;
+
+	/* usual case, breaker closed */
+	map = get_map();
+	hash = health_hash(key);
+	lock_map(map, false);
+	e = find_entry(map, key, hash, false);
+	closed = !e || e->state == HEALTH_CLOSED;
+	unlock_map(map);
+	if (closed)
+		return true;
+
+	/* state may have changed meanwhile */
+	now = time(NULL);
+	lock_map(map, true);
+	e = find_entry(map, key, hash, false);
+	if (e && e->state != HEALTH_CLOSED)
+	{
+		if (now < e->retry_time)
+			ok = false;
+		else
+		{
+			e->state = HEALTH_HALF_OPEN;
+			e->probe_pid = MyProcPid;
+			e->retry_time = now + plproxy_breaker_timeout;
+		}
+	}
+	unlock_map(map);
+	return ok;
+}
+
+/*
+ * Count connection failure.
+ */
+void
+plproxy_health_failure(const char *key, const char *err)
+{
+	HealthMap  *map;
+	HealthEntry *e;
+	time_t		now;
+	int			len;
+
+	if (!key)
+		return;
+
+	map = get_map();
+	now = time(NULL);
+	lock_map(map, true);
+	e = find_entry(map, key, health_hash(key), true);
+
+	/* connections started before breaker opened */
+	if (!e || (e->state == HEALTH_OPEN && now < e->retry_time))
+	{
+		unlock_map(map);
+		return;
+	}
+
+	e->failures++;
+	e->last_failure = now;
+	snprintf(e->last_error, sizeof(e->last_error), "%s", err ? err : "");
+	len = strlen(e->last_error);
+	while (len > 0 && e->last_error[len - 1] == '\n')
+		e->last_error[--len] = 0;
+
+	if (plproxy_breaker_threshold > 0
+		&& (e->state == HEALTH_HALF_OPEN || e->failures >= plproxy_breaker_threshold))
+	{
+		e->state = HEALTH_OPEN;
+		e->retry_time = now + plproxy_breaker_timeout;
+		e->probe_pid = 0;
+	}
+	unlock_map(map);
+}
+
+/*
+ * Partition answered, close the breaker.
+ */
+void
+plproxy_health_success(const char *key)
+{
+	HealthMap  *map;
+	HealthEntry *e;
+	uint32		hash;
+	bool		dirty;
+
+	if (!key)
+		return;
+
+	/* usual case, no failures to forget */
+	map = get_map();
+	hash = health_hash(key);
+	lock_map(map, false);
+	e = find_entry(map, key, hash, false);
+	dirty = e && (e->failures > 0 || e->state != HEALTH_CLOSED);
+	unlock_map(map);
+	if (!dirty)
+		return;
+
+	lock_map(map, true);
+	e = find_entry(map, key, hash, false);
+	if (e)
+	{
+		e->failures = 0;
+		e->state = HEALTH_CLOSED;
+		e->probe_pid = 0;
+	}
+	unlock_map(map);
+}
+
+/*
+ * SQL function: list partitions that have had failures.
+ */
+extern Datum plproxy_health(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plproxy_health);
+
+Datum
+plproxy_health(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	HealthEntry *list;
+	HealthEntry *e;
+	HeapTuple	tup;
+	Datum		values[5];
+	bool		nulls[5];
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext old_ctx;
+		HealthMap  *map = get_map();
+		TupleDesc	tupdesc;
+		int			i,
+					n = 0;
+
+		fctx = SRF_FIRSTCALL_INIT();
+		old_ctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "plproxy_health: return type must be a row type");
+		fctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* copy used entries, dont keep lock while forming tuples */
+		list = palloc(map->nslots * sizeof(HealthEntry));
+		lock_map(map, false);
+		for (i = 0; i < map->nslots; i++)
+		{
+			if (map->slots[i].hash)
+				list[n++] = map->slots[i];
+		}
+		unlock_map(map);
+
+		fctx->user_fctx = list;
+		fctx->max_calls = n;
+		MemoryContextSwitchTo(old_ctx);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	if (fctx->call_cntr >= fctx->max_calls)
+		SRF_RETURN_DONE(fctx);
+
+	list = fctx->user_fctx;
+	e = &list[fctx->call_cntr];
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = DirectFunctionCall1(textin, CStringGetDatum(e->key));
+	values[1] = DirectFunctionCall1(textin, CStringGetDatum(health_state_names[e->state]));
+	values[2] = Int32GetDatum(e->failures);
+	if (e->last_failure)
+		values[3] = TimestampTzGetDatum(time_t_to_timestamptz(e->last_failure));
+	else
+		nulls[3] = true;
+	values[4] = DirectFunctionCall1(textin, CStringGetDatum(e->last_error));
+
+	tup = heap_form_tuple(fctx->tuple_desc, values, nulls);
+	SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(tup));
+}
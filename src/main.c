@@ -26,7 +26,8 @@
  *	 Function results should be allocated from here.
  *
  * - SPI Proc context that activates in SPI_connect() and is freed
- *	 in SPI_finish().  This is used for compile-time short-term storage.
+ *	 in SPI_finish().  SPI is entered only when the call needs to run
+ *	 local queries, then it is also used for short-term storage.
  *
  * - HTAB has its own memory context.
  *
@@ -59,6 +60,54 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(plproxy_call_handler);
 PG_FUNCTION_INFO_V1(plproxy_validator);
 
+void		_PG_init(void);
+
+/* plproxy.max_connect_clusters: max cached CONNECT clusters, 0 = no limit */
+int			plproxy_max_connect_clusters = 0;
+
+/* plproxy.connect_cluster_idle_timeout: drop unused CONNECT clusters (secs) */
+int			plproxy_connect_cluster_idle_timeout = 0;
+
+/* plproxy.max_connections: max open remote connections, 0 = no limit */
+int			plproxy_max_connections = 0;
+
+/* plproxy.dns_cache_ttl: keep resolved partition hosts (secs), 0 = off */
+int			plproxy_dns_cache_ttl = 0;
+
+/* plproxy.breaker_threshold: failures before refusing connects, 0 = off */
+int			plproxy_breaker_threshold = 0;
+
+/* plproxy.breaker_timeout: refuse connects this long before probing (secs) */
+int			plproxy_breaker_timeout = 10;
+
+/*
+ * Module load: register GUCs, reserve shared memory.
+ */
+void
+_PG_init(void)
+{
+	plproxy_define_int_guc("plproxy.max_connect_clusters",
+						   "Max number of cached clusters for CONNECT functions, 0 means no limit.",
+						   &plproxy_max_connect_clusters, 0, 0, INT_MAX, PGC_USERSET, 0);
+	plproxy_define_int_guc("plproxy.connect_cluster_idle_timeout",
+						   "Drop clusters for CONNECT functions unused for this long, 0 means never.",
+						   &plproxy_connect_cluster_idle_timeout, 0, 0, INT_MAX / 1000, PGC_USERSET, GUC_UNIT_S);
+	plproxy_define_int_guc("plproxy.max_connections",
+						   "Max number of open remote connections in backend, 0 means no limit.",
+						   &plproxy_max_connections, 0, 0, INT_MAX, PGC_USERSET, 0);
+	plproxy_define_int_guc("plproxy.dns_cache_ttl",
+						   "Cache resolved partition host addresses for this long, 0 means off.",
+						   &plproxy_dns_cache_ttl, 0, 0, INT_MAX / 1000, PGC_USERSET, GUC_UNIT_S);
+	plproxy_define_int_guc("plproxy.breaker_threshold",
+						   "Consecutive connection failures before partition is considered down, 0 means off.",
+						   &plproxy_breaker_threshold, 0, 0, INT_MAX, PGC_SUSET, 0);
+	plproxy_define_int_guc("plproxy.breaker_timeout",
+						   "How long partition considered down is not connected to.",
+						   &plproxy_breaker_timeout, 10, 1, INT_MAX / 1000, PGC_SUSET, GUC_UNIT_S);
+
+	plproxy_health_init();
+}
+
 /*
  * Centralised error reporting.
  *
@@ -121,9 +170,28 @@ plproxy_remote_error(ProxyFunction *func, ProxyConnection *conn, const PGresult
 		ctx ? errcontext("Remote context: %s", ctx) : 0));
 }
 
+/*
+ * SPI is needed only for local queries, so it is entered on demand.
+ * Tracks whether current call has done SPI_connect().
+ */
+static bool spi_connected = false;
+
+void
+plproxy_spi_connect(void)
+{
+	int			err;
+
+	if (spi_connected)
+		return;
+
+	err = SPI_connect();
+	if (err != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect: %s", SPI_result_code_string(err));
+	spi_connected = true;
+}
+
 /*
  * Library load-time initialization.
- * Do the initialization when SPI is active to simplify the code.
  */
 static bool initialized = false;
 
@@ -142,6 +210,9 @@ plproxy_startup_init(void)
 
 /*
  * Regular maintenance over all clusters.
+ *
+ * Round is started after each PLPROXY_MAINT_PERIOD,
+ * connections are then checked few at a time per call.
  */
 static void
 run_maint(void)
@@ -153,15 +224,19 @@ run_maint(void)
 		return;
 
 	gettimeofday(&now, NULL);
-	if (now.tv_sec - last.tv_sec < 2 * 60)
-		return;
-	last = now;
+	if (now.tv_sec - last.tv_sec >= PLPROXY_MAINT_PERIOD)
+	{
+		last = now;
+		plproxy_cluster_maint(&now);
+		plproxy_dns_maint(&now);
+	}
 
-	plproxy_cluster_maint(&now);
+	plproxy_cluster_maint_step(&now);
+	plproxy_dns_maint_step(&now);
 }
 
 /*
- * Do compilation and execution under SPI.
+ * Do compilation and execution, under SPI if needed.
  *
  * Result conversion will be done without SPI.
  */
@@ -171,35 +246,85 @@ compile_and_execute(FunctionCallInfo fcinfo)
 	int			err;
 	ProxyFunction *func;
 	ProxyCluster *cluster;
+	MemoryContext call_ctx = CurrentMemoryContext;
+	bool		outer_spi = spi_connected;
 
-	/* prepare SPI */
-	err = SPI_connect();
-	if (err != SPI_OK_CONNECT)
-		elog(ERROR, "SPI_connect: %s", SPI_result_code_string(err));
+	/* nested call from local query needs its own SPI connection */
+	spi_connected = false;
 
-	/* do the initialization also under SPI */
-	plproxy_startup_init();
+	PG_TRY();
+	{
+		plproxy_startup_init();
+
+		/* compile code */
+		func = plproxy_compile_and_cache(fcinfo);
+
+		/* local queries will be needed */
+		if (func->needs_spi)
+			plproxy_spi_connect();
+
+		/* get actual cluster to run on */
+		cluster = plproxy_find_cluster(func, fcinfo);
+
+		/* Don't allow nested calls on the same cluster */
+		if (cluster->busy)
+			plproxy_error(func, "Nested PL/Proxy calls to the same cluster are not supported.");
+
+		/* fetch PGresults */
+		func->cur_cluster = cluster;
+		plproxy_exec(func, fcinfo);
+
+		/* done with SPI */
+		if (spi_connected)
+		{
+			spi_connected = false;
+			err = SPI_finish();
+			if (err != SPI_OK_FINISH)
+				elog(ERROR, "SPI_finish: %s", SPI_result_code_string(err));
+		}
+	}
+	PG_CATCH();
+	{
+		/* SPI itself is cleaned up on abort */
+		spi_connected = outer_spi;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-	/* compile code */
-	func = plproxy_compile_and_cache(fcinfo);
+	spi_connected = outer_spi;
 
-	/* get actual cluster to run on */
-	cluster = plproxy_find_cluster(func, fcinfo);
+	/* SPI may have been entered with other context active */
+	MemoryContextSwitchTo(call_ctx);
 
-	/* Don't allow nested calls on the same cluster */
-	if (cluster->busy)
-		plproxy_error(func, "Nested PL/Proxy calls to the same cluster are not supported.");
+	return func;
+}
 
-	/* fetch PGresults */
-	func->cur_cluster = cluster;
-	plproxy_exec(func, fcinfo);
+/*
+ * Result set being returned.
+ */
+typedef struct ProxyRetSet {
+	ProxyFunction *func;
+	ExprContext *econtext;		/* where shutdown callback is registered */
+	uint64		exec_id;		/* cluster->exec_id of this call */
+} ProxyRetSet;
 
-	/* done with SPI */
-	err = SPI_finish();
-	if (err != SPI_OK_FINISH)
-		elog(ERROR, "SPI_finish: %s", SPI_result_code_string(err));
+/*
+ * Executor stopped reading rows early (LIMIT, EXISTS, closed cursor).
+ *
+ * Free remaining results and release connections now, instead of
+ * at next call on the cluster.  Function and cluster may have been
+ * freed meanwhile, so the cluster is looked up by execution id.
+ * Results of later calls are left alone.
+ */
+static void
+ret_set_shutdown(Datum arg)
+{
+	ProxyRetSet *rs = (ProxyRetSet *) DatumGetPointer(arg);
+	ProxyCluster *cluster;
 
-	return func;
+	cluster = plproxy_find_exec_cluster(rs->exec_id);
+	if (cluster && !cluster->busy)
+		plproxy_clean_results(cluster);
 }
 
 /*
@@ -211,18 +336,30 @@ compile_and_execute(FunctionCallInfo fcinfo)
 static Datum
 handle_ret_set(FunctionCallInfo fcinfo)
 {
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
 	ProxyFunction *func;
 	FuncCallContext *ret_ctx;
+	ProxyRetSet *rs;
 
 	if (SRF_IS_FIRSTCALL())
 	{
 		func = compile_and_execute(fcinfo);
 		ret_ctx = SRF_FIRSTCALL_INIT();
-		ret_ctx->user_fctx = func;
+		rs = MemoryContextAllocZero(ret_ctx->multi_call_memory_ctx, sizeof(*rs));
+		rs->func = func;
+		rs->exec_id = func->cur_cluster->exec_id;
+		if (rsinfo && IsA(rsinfo, ReturnSetInfo) && rsinfo->econtext)
+		{
+			rs->econtext = rsinfo->econtext;
+			RegisterExprContextCallback(rs->econtext, ret_set_shutdown,
+										PointerGetDatum(rs));
+		}
+		ret_ctx->user_fctx = rs;
 	}
 
 	ret_ctx = SRF_PERCALL_SETUP();
-	func = ret_ctx->user_fctx;
+	rs = ret_ctx->user_fctx;
+	func = rs->func;
 
 	if (func->cur_cluster->ret_total > 0)
 	{
@@ -230,6 +367,9 @@ handle_ret_set(FunctionCallInfo fcinfo)
 	}
 	else
 	{
+		if (rs->econtext)
+			UnregisterExprContextCallback(rs->econtext, ret_set_shutdown,
+										  PointerGetDatum(rs));
 		plproxy_clean_results(func->cur_cluster);
 		SRF_RETURN_DONE(ret_ctx);
 	}
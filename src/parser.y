@@ -33,7 +33,7 @@
 static ProxyFunction *xfunc;
 
 /* remember what happened */
-static int got_run, got_cluster, got_connect, got_split, got_target;
+static int got_run, got_cluster, got_connect, got_split, got_target, got_readonly;
 
 static QueryBuffer *cluster_sql;
 static QueryBuffer *select_sql;
@@ -46,7 +46,7 @@ static QueryBuffer *cur_sql;
 /* keep the resetting code together with variables */
 static void reset_parser_vars(void)
 {
-	got_run = got_cluster = got_connect = got_split = got_target = 0;
+	got_run = got_cluster = got_connect = got_split = got_target = got_readonly = 0;
 	cur_sql = select_sql = cluster_sql = hash_sql = connect_sql = NULL;
 	xfunc = NULL;
 }
@@ -75,7 +75,8 @@ static void reset_parser_vars(void)
 
 body: | body stmt ;
 
-stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt;
+stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt
+	| readonly_stmt;
 
 connect_stmt: CONNECT connect_spec ';'	{
 					if (got_connect)
@@ -131,6 +132,16 @@ target_stmt: TARGET target_name ';' {
 target_name: IDENT { xfunc->target_name = plproxy_func_strdup(xfunc, $1); }
 		   ;
 
+/* not a keyword, so it can be used as argument name */
+readonly_stmt: IDENT ';' {
+							if (pg_strcasecmp($1, "readonly") != 0)
+								yyerror("syntax error");
+							if (got_readonly)
+								yyerror("Only one READONLY statement allowed");
+							got_readonly = 1;
+							xfunc->read_only = true; }
+			;
+
 split_stmt: SPLIT split_spec ';' {
 							if (got_split)
 								yyerror("Only one SPLIT statement allowed");
@@ -160,6 +171,10 @@ run_spec: hash_func sql_token_list	{ xfunc->run_type = R_HASH; }
 		| NUMBER					{ xfunc->run_type = R_EXACT; xfunc->exact_nr = atoi($1); }
 		| ANY						{ xfunc->run_type = R_ANY; }
 		| ALL						{ xfunc->run_type = R_ALL; }
+		| ALL IDENT					{ /* FIRST is keyword only here */
+									  if (pg_strcasecmp($2, "first") != 0)
+										  yyerror("syntax error");
+									  xfunc->run_type = R_ALL; xfunc->run_first = true; }
 		| hash_direct				{ xfunc->run_type = R_HASH; }
 		;
 
@@ -61,6 +61,7 @@
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
 #include <utils/syscache.h>
+#include <utils/guc.h>
 
 #include "aatree.h"
 #include "rowstamp.h"
@@ -143,6 +144,30 @@
 #define TupleDescAttr(tupdesc, i) ((tupdesc)->attrs[(i)])
 #endif
 
+/*
+ * Custom GUC definition API changed in 8.4 and 9.1.
+ */
+#if PG_VERSION_NUM >= 90100
+#define plproxy_define_int_guc(name, desc, var, boot, min, max, context, flags) \
+	DefineCustomIntVariable(name, desc, NULL, var, boot, min, max, \
+							context, flags, NULL, NULL, NULL)
+#elif PG_VERSION_NUM >= 80400
+#define plproxy_define_int_guc(name, desc, var, boot, min, max, context, flags) \
+	DefineCustomIntVariable(name, desc, NULL, var, boot, min, max, \
+							context, flags, NULL, NULL)
+#else
+#define plproxy_define_int_guc(name, desc, var, boot, min, max, context, flags) \
+	DefineCustomIntVariable(name, desc, NULL, var, min, max, \
+							context, NULL, NULL)
+#endif
+
+#ifndef GUC_UNIT_S
+#define GUC_UNIT_S 0
+#endif
+#ifndef GUC_UNIT_MS
+#define GUC_UNIT_MS 0
+#endif
+
 /*
  * Determine if this argument is to SPLIT
  */
@@ -154,12 +179,72 @@
  */
 #define PLPROXY_MAINT_PERIOD		(2*60)
 
+/*
+ * Maintenance is done incrementally, each call checks
+ * at most this many connections.
+ */
+#define PLPROXY_MAINT_SLICE			16
+
+/*
+ * Cached host addresses refreshed per call during maintenance.
+ * Each is a blocking lookup.
+ */
+#define PLPROXY_DNS_MAINT_SLICE		1
+
 /*
  * Check connections that are idle more than this many seconds.
  * Set 0 to always check.
  */
 #define PLPROXY_IDLE_CONN_CHECK		2
 
+/*
+ * Seconds to wait before retrying failed replacement
+ * connection for connection_lifetime recycling.
+ */
+#define PLPROXY_RECYCLE_RETRY		10
+
+/*
+ * statement_timeout sent to partitions is rounded down to this
+ * many msecs, so it is not sent again on each call.
+ */
+#define PLPROXY_TIMEOUT_STEP		100
+
+/*
+ * Max addresses of one host given to libpq in hostaddr.
+ * Lists are supported since libpq 10.
+ */
+#if PG_VERSION_NUM >= 100000
+#define PLPROXY_DNS_MAX_ADDRS		8
+#else
+#define PLPROXY_DNS_MAX_ADDRS		1
+#endif
+
+/*
+ * Default for drain_timeout: how long to wait for query that was
+ * left running after an error, before dropping the connection.
+ */
+#define PLPROXY_DRAIN_TIMEOUT		10
+
+/*
+ * Partition endpoint that failed to connect is avoided
+ * this many seconds when choosing between replicas.
+ */
+#define PLPROXY_DOWN_RETRY			10
+
+/*
+ * RUN ON ANY tracks response times of partitions as moving average,
+ * new measurement gets this weight.  Measurements older than
+ * PLPROXY_LATENCY_RESET seconds are forgotten, so slow partition
+ * gets tried again.
+ */
+#define PLPROXY_LATENCY_WEIGHT		0.2
+#define PLPROXY_LATENCY_RESET		30
+
+/*
+ * Number of partitions tracked in health map.
+ */
+#define PLPROXY_HEALTH_SLOTS		1024
+
 /* Flag indicating where function should be executed */
 typedef enum RunOnType
 {
@@ -193,6 +278,21 @@ typedef struct ProxyConfig
 	int			keepintvl;
 	int			keepcnt;
 	char		default_user[NAMEDATALEN];
+	int			prewarm;				/* Max parallel connects for prewarm, 0 = off */
+	int			connection_idle_timeout;	/* Close connections unused this long (secs) */
+	int			set_role;				/* Login as pool user, switch with SET ROLE */
+	int			drain_timeout;			/* Wait for abandoned query this long (secs), 0 = drop */
+	char		application_name[NAMEDATALEN];	/* Sent in startup packet */
+	char	   *options;				/* Startup options for remote backend, -c key=val */
+	int			prefer_replicas;		/* READONLY functions skip primary if replicas exist */
+	int			hedge_delay;			/* Resend READONLY query to replica after (msecs), 0 = off */
+	int		   *part_weights;			/* RUN ON ANY weight for each partition, NULL = equal */
+	int			part_weight_count;		/* Number of values in part_weights */
+	int			any_retries;			/* RUN ON ANY: partitions to try after connection failure */
+	int			max_parallel_connects;	/* Max connects in progress per call, 0 = no limit */
+	int			max_parallel_queries;	/* Max queries in progress per call, 0 = no limit */
+	int			partial_deadline;		/* RUN ON ALL: return partial result after (msecs), 0 = off */
+	int			partial_min_percent;	/* Min percent of partitions needed for partial result */
 } ProxyConfig;
 
 typedef struct ConnUserInfo {
@@ -204,31 +304,78 @@ typedef struct ConnUserInfo {
 
 	SysCacheStamp umStamp;
 	bool needs_reload;
+
+	int prewarm_seq;			/* topology_seq of cluster when prewarmed */
+	bool set_role;				/* extra_connstr is for set_role mode */
 } ConnUserInfo;
 
+/*
+ * Actual libpq connection.
+ *
+ * They are shared between all clusters in backend,
+ * keyed by canonical connect string with user info.
+ */
 typedef struct ProxyConnectionState {
-	struct AANode node;			/* node head in user->state tree */
+	struct AANode node;			/* node head in connstr->state tree */
 
-	ConnUserInfo *userinfo;
+	char	   *connstr;		/* Canonical connect string, with user */
+	int			refcount;		/* Number of ConnUserRef pointing here */
+	struct ProxyConnection *cur_conn;	/* Partition connection using it, for notices */
 
 	PGconn	   *db;				/* libpq connection handle */
 	ConnState	state;			/* Connection state */
-	time_t		connect_time;	/* When connection was started */
+	struct timeval connect_time;	/* When connection was started */
 	time_t		query_time;		/* When last query was sent */
 	bool		same_ver;		/* True if dest backend has same X.Y ver */
 	bool		tuning;			/* True if tuning query is running on conn */
 	bool		waitCancel;		/* True if waiting for answer from cancel */
+	char		role[NAMEDATALEN];	/* Role set with SET ROLE, empty if login role */
+	char		tune_role[NAMEDATALEN];	/* Role being set by tuning query */
+	int			stmt_timeout;	/* statement_timeout set on connection (msecs), 0 if not set */
+	int			tune_stmt_timeout;	/* statement_timeout being set by tuning query */
+	int			in_use;			/* Number of clusters having it active, not to be evicted if > 0 */
+
+	/* replacement for connection nearing connection_lifetime */
+	PGconn	   *next_db;		/* Replacement being connected */
+	struct timeval next_connect_time;	/* When last replacement was started */
+	bool		next_wait_write;	/* Replacement waits for write, not read */
+	int			recycle_jitter;	/* Random 0..999, spreads recycle times */
+
+	bool		draining;		/* Query abandoned after error, results are discarded */
+	time_t		drain_time;		/* When draining started */
+
+	/* ring of all states, for incremental maintenance */
+	struct ProxyConnectionState *maint_next;
+	struct ProxyConnectionState *maint_prev;
+
+	/* list of all states in order of use, for plproxy.max_connections */
+	struct ProxyConnectionState *lru_next;
+	struct ProxyConnectionState *lru_prev;
 } ProxyConnectionState;
 
+/* Link from partition connection to shared state for one user */
+typedef struct ConnUserRef {
+	struct AANode node;			/* node head in user->ref tree */
+
+	ConnUserInfo *userinfo;
+	ProxyConnectionState *state;
+} ConnUserRef;
+
 /* Single database connection */
 typedef struct ProxyConnection
 {
 	struct AANode node;
 
 	struct ProxyCluster *cluster;
-	const char *connstr;		/* Connection string for libpq */
+	const char *connstr;		/* Canonical connection string for libpq */
+	const char *host;			/* Host name to resolve via DNS cache, or NULL */
+	const char *health_key;		/* Key in partition health map, or NULL */
+	time_t		down_time;		/* When last connect failed */
+	double		latency;		/* Moving average of query time (msecs) */
+	time_t		latency_time;	/* When latency was last updated */
+	struct timeval query_start;	/* When current query was sent */
 
-	struct AATree userstate_tree; /* user->state tree */
+	struct AATree userstate_tree; /* user->ConnUserRef tree */
 
 	/* state */
 	PGresult   *res;			/* last resultset */
@@ -241,6 +388,10 @@ typedef struct ProxyConnection
 	 */
 	int			run_tag;
 
+	int			part_num;		/* Partition it was tagged for */
+	bool		launched;		/* prepare_conn() done in current call */
+	struct ProxyConnection *hedge_pair;	/* Other connection running same query */
+
 	/*
 	 * Per-connection parameters. These are a assigned just before the 
 	 * remote call is made.
@@ -261,10 +412,22 @@ typedef struct ProxyCluster
 	const char *name;			/* Cluster name */
 	int			version;		/* Cluster version */
 	ProxyConfig config;			/* Cluster config */
+	char	   *startup_params;	/* Connect string part built from config */
+
+	int			topology_seq;	/* Increased on each partition list reload */
 
 	int			part_count;		/* Number of partitions - power of 2 */
 	int			part_mask;		/* Mask to use to get part number from hash */
 	ProxyConnection **part_map; /* Pointers to ProxyConnections */
+	int		   *replica_count;	/* Number of replicas for each partition */
+	ProxyConnection ***replica_map;	/* Replica connections for each partition */
+	int			replica_total;	/* Number of replicas in all partitions */
+	int			failover_left;	/* RUN ON ANY retries left in current call */
+	int		   *missing_parts;	/* Partitions left out of partial result, NULL if not partial */
+	int			missing_count;	/* Number of missing_parts */
+	bool		prewarming;		/* Opening connections only, failures are not fatal */
+	int			first_failed;	/* RUN ON ALL FIRST: number of failed partitions */
+	char	   *first_error;	/* RUN ON ALL FIRST: first failure, reported if no rows found */
 
 	int active_count;			/* number of active connections */
 	ProxyConnection **active_list; /* active ProxyConnection in current query */
@@ -284,6 +447,7 @@ typedef struct ProxyCluster
 	bool		sqlmed_cluster;	/* True if the cluster is defined using SQL/MED */
 	bool		needs_reload;	/* True if the cluster partition list should be reloaded */
 	bool		busy;			/* True if the cluster is already involved in execution */
+	uint64		exec_id;		/* Last execution started, unique in backend */
 
 	/*
 	 * SQL/MED clusters: TIDs of the foreign server and user mapping catalog tuples.
@@ -293,6 +457,10 @@ typedef struct ProxyCluster
 
 	/* notice processing: provide info about currently executing function */
 	struct ProxyFunction	*cur_func;
+
+	/* fake clusters: for LRU and idle timeout */
+	uint64		use_seq;		/* Value of use counter on last call */
+	time_t		last_used;		/* Time of last call */
 } ProxyCluster;
 
 /*
@@ -301,11 +469,17 @@ typedef struct ProxyCluster
  * As the decision to send/receive binary may
  * change in runtime, both text and binary
  * function calls must be cached.
+ *
+ * The structs are shared between all functions in backend,
+ * they must be released with plproxy_free_type().
  */
 typedef struct ProxyType
 {
 	char	   *name;			/* Name of the type */
 	Oid			type_oid;		/* Oid of the type */
+	int			refcount;		/* Users of this struct, including type cache */
+	MemoryContext mem;			/* Holds struct and I/O function state */
+	SysCacheStamp stamp;		/* pg_type row, for cache invalidation */
 
 	Oid			io_param;		/* Extra arg for input_func */
 	bool		for_send;		/* True if for outputting */
@@ -377,6 +551,22 @@ typedef struct DatumArray
 	int			elem_count;
 } DatumArray;
 
+/*
+ * Result shape of untyped RECORD function that is not
+ * currently in use.  Kept to avoid rebuilding the query
+ * when caller switches between few AS (..) lists.
+ */
+typedef struct ProxyRecordVariant
+{
+	ProxyComposite *ret_composite;	/* Type info for the AS (..) list */
+	ProxyQuery *remote_sql;		/* Query built for it */
+	int		   *result_map;		/* Result map for it */
+	int			result_map_nfields;	/* Column count result_map was filled for */
+} ProxyRecordVariant;
+
+/* How many unused result shapes to keep per function */
+#define PLPROXY_RECORD_VARIANTS 8
+
 /*
  * Complete info about compiled function.
  *
@@ -408,11 +598,13 @@ typedef struct ProxyFunction
 	ProxyQuery *cluster_sql;	/* Optional query for name resolving */
 
 	RunOnType	run_type;		/* Run type */
+	bool		run_first;		/* RUN ON ALL FIRST: stop at first non-empty result */
 	ProxyQuery *hash_sql;		/* Hash execution for R_HASH */
 	int			exact_nr;		/* Hash value for R_EXACT */
 	const char *connect_str;	/* libpq string for CONNECT function */
 	ProxyQuery *connect_sql;	/* Optional query for CONNECT function */
 	const char *target_name;	/* Optional target function name */
+	bool		read_only;		/* READONLY: may run on partition replicas */
 
 	/*
 	 * calculated data
@@ -420,6 +612,9 @@ typedef struct ProxyFunction
 
 	ProxyQuery *remote_sql;		/* query to be run repotely */
 
+	/* true if call runs local queries: hash, cluster or connect */
+	bool		needs_spi;
+
 	/*
 	 * current execution data
 	 */
@@ -432,9 +627,22 @@ typedef struct ProxyFunction
 
 	/*
 	 * Maps result field num to libpq column num.
-	 * It is filled for each result.  NULL when scalar result.
+	 * It is filled when result shape changes.  NULL when scalar result.
 	 */
 	int		   *result_map;
+
+	/*
+	 * Column count of result that result_map was filled for,
+	 * -1 if not filled.  Column names are rechecked on use.
+	 */
+	int			result_map_nfields;
+
+	/*
+	 * Untyped RECORD: previously used result shapes,
+	 * most recently used first.
+	 */
+	ProxyRecordVariant *record_variants;
+	int			record_variant_count;
 } ProxyFunction;
 
 /* main.c */
@@ -443,6 +651,13 @@ Datum		plproxy_validator(PG_FUNCTION_ARGS);
 void		plproxy_error_with_state(ProxyFunction *func, int sqlstate, const char *fmt, ...)
 	__attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
 void		plproxy_remote_error(ProxyFunction *func, ProxyConnection *conn, const PGresult *res, bool iserr);
+void		plproxy_spi_connect(void);
+extern int	plproxy_max_connect_clusters;
+extern int	plproxy_connect_cluster_idle_timeout;
+extern int	plproxy_max_connections;
+extern int	plproxy_dns_cache_ttl;
+extern int	plproxy_breaker_threshold;
+extern int	plproxy_breaker_timeout;
 #define plproxy_error(func,...) plproxy_error_with_state((func), ERRCODE_INTERNAL_ERROR, __VA_ARGS__)
 
 /* function.c */
@@ -454,11 +669,14 @@ bool		plproxy_split_add_ident(ProxyFunction *func, const char *ident);
 void		plproxy_split_all_arrays(ProxyFunction *func);
 ProxyFunction *plproxy_compile_and_cache(FunctionCallInfo fcinfo);
 ProxyFunction *plproxy_compile(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool validate_only);
+void		plproxy_function_forget_cluster(ProxyCluster *cluster);
 
 /* execute.c */
 void		plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo);
 void		plproxy_clean_results(ProxyCluster *cluster);
 void		plproxy_disconnect(ProxyConnectionState *cur);
+void		plproxy_recycle_connection(ProxyConnection *conn, ProxyConnectionState *cur, struct timeval *now);
+void		plproxy_drain_connection(ProxyConfig *cf, ProxyConnectionState *cur, time_t now);
 
 /* scanner.c */
 int			plproxy_yyget_lineno(void);
@@ -488,7 +706,24 @@ void		plproxy_cluster_cache_init(void);
 void		plproxy_syscache_callback_init(void);
 ProxyCluster *plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo);
 void		plproxy_cluster_maint(struct timeval * now);
+void		plproxy_cluster_maint_step(struct timeval * now);
 void		plproxy_activate_connection(struct ProxyConnection *conn);
+bool		plproxy_evict_idle_connection(void);
+void		plproxy_touch_connection(ProxyConnectionState *state);
+ProxyCluster *plproxy_find_exec_cluster(uint64 exec_id);
+
+/* dns.c */
+char	   *plproxy_dns_host(const char *connstr);
+bool		plproxy_dns_lookup(const char *host, const char **hosts_p, const char **addrs_p);
+void		plproxy_dns_maint(struct timeval * now);
+void		plproxy_dns_maint_step(struct timeval * now);
+
+/* health.c */
+void		plproxy_health_init(void);
+char	   *plproxy_health_key(const char *connstr);
+bool		plproxy_health_allow(const char *key);
+void		plproxy_health_failure(const char *key, const char *err);
+void		plproxy_health_success(const char *key);
 
 /* result.c */
 Datum		plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo);
@@ -503,5 +738,6 @@ void		plproxy_query_prepare(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQ
 void		plproxy_query_exec(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *q,
 							   DatumArray **array_params, int array_row);
 void		plproxy_query_freeplan(ProxyQuery *q);
+void		plproxy_query_free(ProxyQuery *q);
 
 #endif
@@ -261,6 +261,7 @@ plproxy_query_prepare(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *
 	}
 
 	/* prepare & store plan */
+	plproxy_spi_connect();
 	plan = SPI_prepare(q->sql, q->arg_count, types);
 	q->plan = SPI_saveplan(plan);
 }
@@ -322,3 +323,17 @@ plproxy_query_freeplan(ProxyQuery *q)
 	SPI_freeplan(q->plan);
 	q->plan = NULL;
 }
+
+/*
+ * Release ProxyQuery and its plan.
+ */
+void
+plproxy_query_free(ProxyQuery *q)
+{
+	if (!q)
+		return;
+	plproxy_query_freeplan(q);
+	pfree(q->sql);
+	pfree(q->arg_lookup);
+	pfree(q);
+}
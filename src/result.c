@@ -38,7 +38,39 @@ name_matches(ProxyFunction *func, const char *aname, PGresult *res, int col)
 	return false;
 }
 
-/* fill func->result_map */
+/*
+ * Check if result_map from last time fits this result:
+ * every field is still at the column it was mapped to.
+ */
+static bool
+result_map_valid(ProxyFunction *func, PGresult *res, int nfields)
+{
+	Form_pg_attribute a;
+	int			xi,
+				natts = func->ret_composite->tupdesc->natts;
+
+	if (func->result_map_nfields != nfields)
+		return false;
+
+	for (xi = 0; xi < natts; xi++)
+	{
+		a = TupleDescAttr(func->ret_composite->tupdesc, xi);
+		if (a->attisdropped)
+			continue;
+		if (!name_matches(func, NameStr(a->attname), res, func->result_map[xi]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Fill func->result_map.
+ *
+ * Remote result shape rarely changes, so the map is
+ * recalculated only when column names differ from last time.
+ * Names are still compared once per result, so only results with
+ * reordered columns gain, ones in order cost the same as before.
+ */
 static void
 map_results(ProxyFunction *func, PGresult *res)
 {
@@ -64,6 +96,12 @@ map_results(ProxyFunction *func, PGresult *res)
 	if (nfields > func->ret_composite->nfields)
 		plproxy_error(func, "Got too many fields from remote end");
 
+	if (result_map_valid(func, res, nfields))
+		return;
+
+	/* in case of error below */
+	func->result_map_nfields = -1;
+
 	for (i = -1, xi = 0; xi < natts; xi++)
 	{
 		/* ->name_list has quoted names, take unquoted from ->tupdesc */
@@ -102,6 +140,8 @@ map_results(ProxyFunction *func, PGresult *res)
 			plproxy_error(func,
 						  "Field %s does not exists in result", aname);
 	}
+
+	func->result_map_nfields = nfields;
 }
 
 /* Return connection where are unreturned rows */
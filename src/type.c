@@ -23,6 +23,71 @@
 
 #include "plproxy.h"
 
+/*
+ * ProxyType structs do not depend on function, so they are
+ * shared by all functions in backend.  The cache keeps one
+ * reference to each type, functions keep one per use.
+ */
+
+typedef struct TypeCacheKey
+{
+	Oid			type_oid;
+	bool		for_send;
+} TypeCacheKey;
+
+typedef struct TypeCacheEntry
+{
+	TypeCacheKey key;			/* Hash key, must be first */
+	ProxyType  *type;
+} TypeCacheEntry;
+
+static HTAB *type_cache = NULL;
+
+static MemoryContext type_cache_mem = NULL;
+
+/*
+ * Drop invalidated types from cache.  Functions that still
+ * use them keep their copy until they are freed.
+ */
+static void
+TypeSyscacheCallback(Datum arg, int cacheid, SCInvalArg newStamp)
+{
+	HASH_SEQ_STATUS seq;
+	TypeCacheEntry *entry;
+	ProxyType  *type;
+
+	hash_seq_init(&seq, type_cache);
+	while ((entry = hash_seq_search(&seq)) != NULL)
+	{
+		type = entry->type;
+		if (!scstamp_check(TYPEOID, &type->stamp, newStamp))
+			continue;
+		hash_search(type_cache, &entry->key, HASH_REMOVE, NULL);
+		plproxy_free_type(type);
+	}
+}
+
+static void
+type_cache_init(void)
+{
+	HASHCTL		ctl;
+
+	type_cache_mem = AllocSetContextCreate(TopMemoryContext,
+										   "PL/Proxy type cache",
+										   ALLOCSET_SMALL_MINSIZE,
+										   ALLOCSET_SMALL_INITSIZE,
+										   ALLOCSET_DEFAULT_MAXSIZE);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(TypeCacheKey);
+	ctl.entrysize = sizeof(TypeCacheEntry);
+	ctl.hash = tag_hash;
+	type_cache = hash_create("PL/Proxy type cache", 64, &ctl,
+							 HASH_ELEM | HASH_FUNCTION);
+
+	CacheRegisterSyscacheCallback(TYPEOID, TypeSyscacheCallback, (Datum) 0);
+}
+
 /*
  * Checks if we can safely use binary.
  */
@@ -150,25 +215,39 @@ plproxy_composite_info(ProxyFunction *func, TupleDesc tupdesc)
 
 	ret->nfields = 0;
 	for (i = 0; i < natts; i++)
+		ret->type_list[i] = NULL;
+
+	PG_TRY();
 	{
-		a = TupleDescAttr(tupdesc, i);
-		if (a->attisdropped)
+		for (i = 0; i < natts; i++)
 		{
-			ret->name_list[i] = NULL;
-			ret->type_list[i] = NULL;
-			continue;
+			a = TupleDescAttr(tupdesc, i);
+			if (a->attisdropped)
+			{
+				ret->name_list[i] = NULL;
+				ret->type_list[i] = NULL;
+				continue;
+			}
+			ret->nfields++;
+
+			name = quote_identifier(NameStr(a->attname));
+			ret->name_list[i] = plproxy_func_strdup(func, name);
+
+			type = plproxy_find_type_info(func, a->atttypid, 0);
+			ret->type_list[i] = type;
+
+			if (!type->has_recv)
+				ret->use_binary = 0;
 		}
-		ret->nfields++;
-
-		name = quote_identifier(NameStr(a->attname));
-		ret->name_list[i] = plproxy_func_strdup(func, name);
-
-		type = plproxy_find_type_info(func, a->atttypid, 0);
-		ret->type_list[i] = type;
-
-		if (!type->has_recv)
-			ret->use_binary = 0;
 	}
+	PG_CATCH();
+	{
+		/* release types taken so far, rest is in function context */
+		for (i = 0; i < natts; i++)
+			plproxy_free_type(ret->type_list[i]);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
 	return ret;
 }
@@ -191,21 +270,22 @@ plproxy_free_composite(ProxyComposite *rec)
 	pfree(rec);
 }
 
+/* Release reference to type info, free it if last one */
 void
 plproxy_free_type(ProxyType *type)
 {
 	if (type == NULL)
 		return;
 
-	if (type->name)
-		pfree(type->name);
+	Assert(type->refcount > 0);
+	if (--type->refcount > 0)
+		return;
 
 	if (type->elem_type_t)
 		plproxy_free_type(type->elem_type_t);
 
-	/* hopefully I/O functions do not use ->fn_extra */
-
-	pfree(type);
+	/* struct, name and whatever I/O functions keep in ->fn_extra */
+	MemoryContextDelete(type->mem);
 }
 
 /*
@@ -272,6 +352,25 @@ plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send)
 	Form_pg_namespace s_nsp;
 	char		namebuf[NAMEDATALEN * 4 + 2 + 1 + 2 + 1];
 	Oid			nsoid;
+	TypeCacheKey key;
+	TypeCacheEntry *entry;
+	bool		found;
+	MemoryContext mem;
+
+	if (type_cache == NULL)
+		type_cache_init();
+
+	/* key may have padding */
+	memset(&key, 0, sizeof(key));
+	key.type_oid = oid;
+	key.for_send = for_send;
+
+	entry = hash_search(type_cache, &key, HASH_FIND, NULL);
+	if (entry)
+	{
+		entry->type->refcount++;
+		return entry->type;
+	}
 
 	/* fetch pg_type row */
 	t_type = SearchSysCache(TYPEOID, ObjectIdGetDatum(oid), 0, 0, 0);
@@ -317,47 +416,60 @@ plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send)
 			break;
 	}
 
-	/* allocate & fill structure */
-	type = plproxy_func_alloc(func, sizeof(*type));
-	memset(type, 0, sizeof(*type));
+	/* allocate & fill structure, in own context so ->fn_extra is freed with it */
+	mem = AllocSetContextCreate(type_cache_mem,
+								"PL/Proxy type",
+								ALLOCSET_SMALL_MINSIZE,
+								ALLOCSET_SMALL_INITSIZE,
+								ALLOCSET_SMALL_MAXSIZE);
+	type = MemoryContextAllocZero(mem, sizeof(*type));
 
+	type->mem = mem;
 	type->type_oid = oid;
 	type->io_param = getTypeIOParam(t_type);
 	type->for_send = for_send;
 	type->by_value = s_type->typbyval;
-	type->name = plproxy_func_strdup(func, namebuf);
+	type->name = MemoryContextStrdup(mem, namebuf);
 	type->is_array = (s_type->typelem != 0 && s_type->typlen == -1);
 	type->elem_type_oid = s_type->typelem;
 	type->elem_type_t = NULL;
 	type->alignment = s_type->typalign;
 	type->length = s_type->typlen;
+	scstamp_set(TYPEOID, &type->stamp, t_type);
 
 	/* decide what function is needed */
 	if (for_send)
 	{
-		fmgr_info_cxt(s_type->typoutput, &type->io.out.output_func, func->ctx);
+		fmgr_info_cxt(s_type->typoutput, &type->io.out.output_func, mem);
 		if (OidIsValid(s_type->typsend) && usable_binary(oid))
 		{
-			fmgr_info_cxt(s_type->typsend, &type->io.out.send_func, func->ctx);
+			fmgr_info_cxt(s_type->typsend, &type->io.out.send_func, mem);
 			type->has_send = 1;
 		}
 	}
 	else
 	{
-		fmgr_info_cxt(s_type->typinput, &type->io.in.input_func, func->ctx);
+		fmgr_info_cxt(s_type->typinput, &type->io.in.input_func, mem);
 		if (OidIsValid(s_type->typreceive) && usable_binary(oid))
 		{
-			fmgr_info_cxt(s_type->typreceive, &type->io.in.recv_func, func->ctx);
+			fmgr_info_cxt(s_type->typreceive, &type->io.in.recv_func, mem);
 			type->has_recv = 1;
 		}
 	}
 
 	ReleaseSysCache(t_type);
 
+	/* one reference for cache, one for caller */
+	entry = hash_search(type_cache, &key, HASH_ENTER, &found);
+	if (found)
+		plproxy_free_type(entry->type);
+	entry->type = type;
+	type->refcount = 2;
+
 	return type;
 }
 
-/* Get cached type info for array elems */
+/* Get cached type info for array elems, owned by array type */
 ProxyType *plproxy_get_elem_type(ProxyFunction *func, ProxyType *type, bool for_send)
 {
 	if (!type->elem_type_t)
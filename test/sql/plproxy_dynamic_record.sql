@@ -29,6 +29,11 @@ insert into dynamic_query_test values ( 2, 'user2', 'foo');
 select * from dynamic_query('select * from dynamic_query_test') as (id integer, username text, other text);
 select * from dynamic_query('select id, username from dynamic_query_test') as foo(id integer, username text);
 
+-- switch between known result shapes
+select * from dynamic_query('select * from dynamic_query_test') as (id integer, username text, other text);
+select * from dynamic_query('select username, id from dynamic_query_test') as (username text, id integer);
+select * from dynamic_query('select id, username from dynamic_query_test') as foo(id integer, username text);
+
 
 -- test errors
 create or replace function dynamic_query_select()
@@ -62,3 +62,103 @@ returns setof integer as $$ cluster 'testcluster'; run on any; $$ language plpro
 select distinct test_multi(0, 'foo') from generate_series(1,20) order by 1;
 
 
+
+-- test RUN ON ALL FIRST
+create function test_first(part integer)
+returns setof text as $$
+    cluster 'testcluster';
+    run on all first;
+    select current_database()::text where current_database() = 'test_part' || part;
+$$ language plproxy;
+select * from test_first(2);
+select * from test_first(5);
+
+create function test_first_one(part integer)
+returns text as $$
+    cluster 'testcluster';
+    run on all first;
+    select current_database()::text where current_database() = 'test_part' || part;
+$$ language plproxy;
+select test_first_one(3);
+
+-- READONLY is not reserved word
+create function test_readonly_arg(readonly integer)
+returns text as $$
+    cluster 'testcluster';
+    run on readonly;
+    readonly;
+    select current_database()::text;
+$$ language plproxy;
+select test_readonly_arg(1);
+
+-- RUN ON ALL FIRST: failed partition is left out if others have rows
+create function test_first_err(part integer)
+returns setof text as $$
+    cluster 'testcluster';
+    run on all first;
+    select x from (select case when current_database() = 'test_part' || part
+                               then current_database()::text end as x,
+                          1 / (case when current_database() = 'test_part0' then 0 else 1 end) as chk
+                    offset 0) s
+     where x is not null and chk = 1;
+$$ language plproxy;
+select * from test_first_err(2);
+select * from test_first_err(0);
+
+-- RUN ON ALL FIRST: queries on other partitions are canceled
+create function test_first_cancel(part integer)
+returns setof text as $$
+    cluster 'testcluster';
+    run on all first;
+    select current_database()::text
+      from pg_sleep(case when current_database() = 'test_part' || part then 0 else 30 end);
+$$ language plproxy;
+-- query left running would be dropped by next call with NOTICE after drain_timeout
+select * from test_first_cancel(1);
+select * from test_first_cancel(2);
+
+-- FIRST is not reserved word
+create function test_first_arg(first integer)
+returns text as $$
+    cluster 'testcluster';
+    run on first;
+    select current_database()::text;
+$$ language plproxy;
+select test_first_arg(3);
+
+-- stop reading rows early
+create function test_all_rows()
+returns setof text as $$
+    cluster 'testcluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+select count(*) from (select test_all_rows() limit 2) x;
+select exists (select test_all_rows());
+select count(*) from test_all_rows();
+
+-- connections of stopped set are free for other calls
+create function test_other_conn()
+returns text as $$
+    connect 'dbname=test_part';
+    select current_database()::text;
+$$ language plproxy;
+set plproxy.max_connections = 4;
+select count(*) from (select test_all_rows() limit 2) x;
+select test_other_conn();
+reset plproxy.max_connections;
+
+-- local statement_timeout is passed to partitions
+create function test_remote_timeout()
+returns text as $$
+    cluster 'testcluster';
+    run on 0;
+    select setting::text from pg_settings where name = 'statement_timeout';
+$$ language plproxy;
+set statement_timeout = '20s';
+select test_remote_timeout()::int between 10000 and 20000;
+-- sent again when partition would run longer than local time left
+select t::int % 100 = 0 as rounded, t::int <= 19000 as lowered
+  from (select test_remote_timeout() as t from pg_sleep(1) offset 0) s;
+reset statement_timeout;
+select test_remote_timeout();
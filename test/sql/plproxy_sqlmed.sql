@@ -122,3 +122,363 @@ drop server testcluster cascade;
 -- back on testcluster again
 select * from sqlmed_compat_test();
 
+-- startup parameters from cluster options
+create server startupcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             application_name 'plproxy_test',
+             options '-c work_mem=1234kB');
+create user mapping for public server startupcluster;
+
+create or replace function sqlmed_startup_test() returns setof text as $$
+    cluster 'startupcluster';
+    run on 0;
+    select current_setting('application_name') || ' ' || current_setting('work_mem');
+$$ language plproxy;
+
+select * from sqlmed_startup_test();
+
+-- other options are still integer
+alter server startupcluster options (add query_timeout 'abc');
+
+drop server startupcluster cascade;
+
+-- partition replicas
+create server replicacluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_0_replica1 'dbname=test_part1 host=localhost',
+             prefer_replicas '1');
+create user mapping for public server replicacluster;
+
+create or replace function sqlmed_replica_rw() returns setof text as $$
+    cluster 'replicacluster';
+    run on 0;
+    select current_database()::text;
+$$ language plproxy;
+
+create or replace function sqlmed_replica_ro() returns setof text as $$
+    cluster 'replicacluster';
+    run on 0;
+    readonly;
+    select current_database()::text;
+$$ language plproxy;
+
+select * from sqlmed_replica_rw();
+select * from sqlmed_replica_ro();
+
+-- replica for missing partition
+alter server replicacluster options (add partition_1_replica1 'dbname=test_part1');
+select * from sqlmed_replica_ro();
+
+drop server replicacluster cascade;
+
+-- run on any failover
+create server failovercluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_nonexist host=localhost',
+             partition_1 'dbname=test_part1 host=localhost',
+             any_retries '1');
+create user mapping for public server failovercluster;
+
+create or replace function sqlmed_failover() returns setof text as $$
+    cluster 'failovercluster';
+    run on any;
+    select current_database()::text;
+$$ language plproxy;
+
+select * from sqlmed_failover();
+select * from sqlmed_failover();
+select * from sqlmed_failover();
+
+drop server failovercluster cascade;
+
+-- partition health
+set plproxy.breaker_threshold = 3;
+create server downcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_down host=localhost');
+create user mapping for public server downcluster;
+
+create or replace function sqlmed_down() returns setof text as $$
+    cluster 'downcluster';
+    run on 0;
+    select current_database()::text;
+$$ language plproxy;
+
+create or replace function sqlmed_down_try() returns text as $$
+begin
+    perform sqlmed_down();
+    return 'ok';
+exception when others then
+    return 'failed';
+end;
+$$ language plpgsql;
+
+select sqlmed_down_try(), sqlmed_down_try(), sqlmed_down_try();
+select partition, state, failures from plproxy_partition_health
+ where partition like '%test_down%';
+select * from sqlmed_down();
+
+reset plproxy.breaker_threshold;
+drop server downcluster cascade;
+
+-- partial results
+create server partialcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_nonexist host=localhost',
+             partition_1 'dbname=test_part1 host=localhost',
+             partial_deadline '5000');
+create user mapping for public server partialcluster;
+
+create or replace function sqlmed_partial() returns setof text as $$
+    cluster 'partialcluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+
+-- missing partitions are reported
+set client_min_messages = 'notice';
+select * from sqlmed_partial();
+set client_min_messages = 'warning';
+
+alter server partialcluster options (add partial_min_percent '60');
+select * from sqlmed_partial();
+
+drop server partialcluster cascade;
+
+-- prewarm opens all partitions, failures are counted in health map
+create server prewarmcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_prewarm_down host=localhost',
+             prewarm '2');
+create user mapping for public server prewarmcluster;
+
+create or replace function sqlmed_prewarm() returns setof text as $$
+    cluster 'prewarmcluster';
+    run on 0;
+    select current_database()::text;
+$$ language plproxy;
+
+select * from sqlmed_prewarm();
+select partition, failures from plproxy_partition_health
+ where partition like '%test_prewarm_down%';
+select * from sqlmed_prewarm();
+
+drop server prewarmcluster cascade;
+
+-- set_role: one connection as mapped user, caller set with SET ROLE
+create server rolecluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost', set_role '1');
+create server norolecluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost');
+create user mapping for public server rolecluster options (user 'test_user_bob');
+create user mapping for public server norolecluster options (user 'test_user_bob');
+grant usage on foreign server rolecluster to test_user_alice;
+grant usage on foreign server rolecluster to test_user_charlie;
+grant usage on foreign server norolecluster to test_user_alice;
+grant test_user_alice to test_user_bob;
+
+create or replace function sqlmed_role() returns setof text as $$
+    cluster 'rolecluster';
+    run on 0;
+    select current_user::text;
+$$ language plproxy;
+create or replace function sqlmed_norole() returns setof text as $$
+    cluster 'norolecluster';
+    run on 0;
+    select current_user::text;
+$$ language plproxy;
+
+set session authorization test_user_alice;
+select * from sqlmed_role();
+select * from sqlmed_norole();
+select * from sqlmed_role();
+reset session authorization;
+
+-- failed SET ROLE is not remembered
+set session authorization test_user_charlie;
+select * from sqlmed_role();
+select * from sqlmed_role();
+reset session authorization;
+
+-- usage is checked for caller
+set session authorization test_user_bob;
+select * from sqlmed_role();
+reset session authorization;
+
+revoke test_user_alice from test_user_bob;
+drop server rolecluster cascade;
+drop server norolecluster cascade;
+
+-- plproxy.max_connections: idle connections are closed, busy ones not
+create server limitcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_part1 host=localhost');
+create user mapping for public server limitcluster options (user 'test_user_bob');
+create or replace function sqlmed_limit(i int) returns setof text as $$
+    cluster 'limitcluster';
+    run on i;
+    select current_database()::text;
+$$ language plproxy;
+create or replace function sqlmed_limit_all() returns setof text as $$
+    cluster 'limitcluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+
+set plproxy.max_connections = 1;
+select * from sqlmed_limit(0);
+select * from sqlmed_limit(1);
+select * from sqlmed_limit(0);
+select * from sqlmed_limit_all();
+reset plproxy.max_connections;
+select * from sqlmed_limit_all() order by 1;
+
+drop server limitcluster cascade;
+
+-- connection_lifetime: replacement is opened while old connection is used
+create server recyclecluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             connection_lifetime '1');
+create user mapping for public server recyclecluster;
+
+create or replace function sqlmed_recycle() returns setof int4 as $$
+    cluster 'recyclecluster';
+    run on 0;
+    select pg_backend_pid();
+$$ language plproxy;
+
+-- replacement is polled on each use
+create or replace function sqlmed_recycle_wait(old_pid int4) returns text as $$
+declare
+    i int4;
+begin
+    for i in 1..100 loop
+        if sqlmed_recycle() <> old_pid then
+            return 'replaced';
+        end if;
+        perform pg_sleep(0.05);
+    end loop;
+    return 'not replaced';
+end;
+$$ language plpgsql;
+
+create temp table recycle_pid as select sqlmed_recycle() as pid;
+select sqlmed_recycle() = pid as same_conn from recycle_pid;
+select sqlmed_recycle_wait(pid) from recycle_pid;
+
+drop table recycle_pid;
+drop server recyclecluster cascade;
+
+-- drain_timeout: query left running after error is drained, connection kept
+create server draincluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_part1 host=localhost',
+             drain_timeout '10');
+create user mapping for public server draincluster;
+
+create or replace function sqlmed_drain_pid() returns setof int4 as $$
+    cluster 'draincluster';
+    run on 1;
+    select pg_backend_pid();
+$$ language plproxy;
+
+create or replace function sqlmed_drain_fail() returns setof int4 as $$
+    cluster 'draincluster';
+    run on all;
+    select 1 / (case when current_database() = 'test_part0' then 0 else rsleep(1) end);
+$$ language plproxy;
+
+create temp table drain_pid as select sqlmed_drain_pid() as pid;
+select * from sqlmed_drain_fail();
+select sqlmed_drain_pid() = pid as same_conn from drain_pid;
+
+-- without drain_timeout the connection is dropped
+alter server draincluster options (set drain_timeout '0');
+truncate drain_pid;
+insert into drain_pid select sqlmed_drain_pid();
+select * from sqlmed_drain_fail();
+select sqlmed_drain_pid() = pid as same_conn from drain_pid;
+
+drop table drain_pid;
+drop server draincluster cascade;
+
+-- hedge_delay: slow endpoint is bypassed by the other one
+create server hedgecluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_0_replica1 'dbname=test_part1 host=localhost',
+             hedge_delay '200');
+create user mapping for public server hedgecluster;
+
+create or replace function sqlmed_hedge() returns setof text as $$
+    cluster 'hedgecluster';
+    run on 0;
+    readonly;
+    select current_database()::text
+      from rsleep(case when current_database() = 'test_part0' then 3 else 0 end);
+$$ language plproxy;
+
+select * from sqlmed_hedge();
+select * from sqlmed_hedge();
+select * from sqlmed_hedge();
+
+drop server hedgecluster cascade;
+
+-- partition_weights: partition with weight 0 is not used by RUN ON ANY
+create server weightcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_part1 host=localhost',
+             partition_weights '0,1');
+create user mapping for public server weightcluster;
+
+create or replace function sqlmed_weight() returns setof text as $$
+    cluster 'weightcluster';
+    run on any;
+    select current_database()::text;
+$$ language plproxy;
+
+select distinct sqlmed_weight() from generate_series(1, 20);
+alter server weightcluster options (set partition_weights '5,0');
+select distinct sqlmed_weight() from generate_series(1, 20);
+
+drop server weightcluster cascade;
+
+-- max_parallel_connects, max_parallel_queries: rest of partitions wait
+create server parallelcluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_part1 host=localhost',
+             partition_2 'dbname=test_part2 host=localhost',
+             partition_3 'dbname=test_part3 host=localhost',
+             max_parallel_connects '1',
+             max_parallel_queries '2');
+create user mapping for public server parallelcluster;
+
+-- returns number of its queries running at once, seen after sleep
+create or replace function sqlmed_parallel() returns setof int4 as $$
+    cluster 'parallelcluster';
+    run on all;
+    select (select count(*) from pg_stat_activity
+             where state = 'active' and query = current_query())::int4
+      from pg_sleep(0.3);
+$$ language plproxy;
+
+select count(*), max(n) <= 2 as limited from sqlmed_parallel() n;
+alter server parallelcluster options (set max_parallel_queries '1');
+select count(*), max(n) as running from sqlmed_parallel() n;
+
+drop server parallelcluster cascade;
+
+-- plproxy.dns_cache_ttl: connections use cached addresses of host
+set plproxy.dns_cache_ttl = 60;
+create server dnscluster foreign data wrapper plproxy
+    options (partition_0 'dbname=test_part0 host=localhost',
+             partition_1 'dbname=test_part1 host=localhost');
+create user mapping for public server dnscluster;
+
+create or replace function sqlmed_dns() returns setof text as $$
+    cluster 'dnscluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+
+select * from sqlmed_dns() order by 1;
+select * from sqlmed_dns() order by 1;
+
+reset plproxy.dns_cache_ttl;
+drop server dnscluster cascade;